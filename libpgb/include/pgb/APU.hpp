@@ -0,0 +1,84 @@
+#ifndef PGB_APU_HPP
+#define PGB_APU_HPP
+
+#include <cstdint>
+#include <array>
+#include "BlipBuffer.hpp"
+
+constexpr uint64_t CLOCK_RATE = 4194304;
+// The frame sequencer clocks length, sweep and envelope at 512 Hz
+constexpr uint64_t CLOCK_FRAME_SEQUENCER = 8192;
+
+struct APU_CHANNEL {
+  bool enabled = false;
+  bool lengthEnable = false;
+  uint16_t length = 0;
+  // Absolute clock of the next frequency timer expiry
+  uint64_t nextTick = 0;
+  // Duty step or wave sample index
+  uint8_t position = 0;
+  uint8_t volume = 0;
+  uint8_t envelopeTimer = 0;
+  // Digital level (0-15) currently being mixed
+  uint8_t output = 0;
+};
+
+// Sound hardware (FF10-FF3F). Nothing runs per cycle: the channels are only
+// brought up to date when a sound register is touched, samples are drained,
+// or a frame ends, and every amplitude change is rendered as a band-limited
+// step at its exact clock.
+class APU {
+public:
+  explicit APU(uint32_t sampleRate = 48000);
+
+  uint8_t read(uint16_t addr, uint64_t clock);
+  void write(uint16_t addr, uint8_t value, uint64_t clock);
+
+  // Runs the sound hardware up to `clock`
+  void catchUp(uint64_t clock);
+
+  // With synthesis off only the registers are emulated: length counters,
+  // sweep, NR52 status and wave RAM stay exact, but no samples are produced
+  // and idle stretches are skipped outright. Meant for headless runs.
+  void setSynthesis(bool enabled, uint64_t clock);
+  inline bool synthesis() const { return synthesize; }
+
+  inline uint32_t sampleRate() const { return blip.sampleRate(); }
+  // Stereo sample frames ready once caught up to `clock`
+  size_t samplesAvailable(uint64_t clock);
+  // Catches up to `clock` and reads up to `frames` interleaved left/right samples
+  size_t readSamples(int16_t *out, size_t frames, uint64_t clock);
+
+private:
+  BlipBuffer blip;
+  // FF10-FF3F as last written, wave RAM included
+  std::array<uint8_t, 0x30> registers{};
+  std::array<APU_CHANNEL, 4> channels{};
+  uint64_t lastClock = 0;
+  bool power = false;
+  bool synthesize = true;
+  // Mixer gain per channel from NR50/NR51
+  std::array<int32_t, 4> gainLeft{};
+  std::array<int32_t, 4> gainRight{};
+
+  uint16_t sweepShadow = 0;
+  uint8_t sweepTimer = 0;
+  bool sweepEnabled = false;
+  uint16_t lfsr = 0x7FFF;
+
+  inline uint8_t &reg(int channel, int index) { return registers[channel * 5 + index]; }
+  inline uint16_t frequency(int channel) { return reg(channel, 3) | (reg(channel, 4) & 0x7u) << 8u; }
+  bool dacOn(int channel);
+  uint64_t period(int channel);
+  uint8_t level(int channel);
+  void setOutput(int channel, uint8_t value, uint64_t clock);
+  void updateGains(uint64_t clock);
+
+  void runChannels(uint64_t end);
+  bool sequencerIdle() const;
+  void sequencerStep(uint64_t clock);
+  void trigger(int channel, uint64_t clock);
+  uint16_t sweepFrequency();
+};
+
+#endif //PGB_APU_HPP
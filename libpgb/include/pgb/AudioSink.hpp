@@ -0,0 +1,74 @@
+#ifndef PGB_AUDIOSINK_HPP
+#define PGB_AUDIOSINK_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <atomic>
+#include <vector>
+#include "SpscRing.hpp"
+
+// Hands audio from the emulation thread to the host audio callback. The
+// emulator pushes interleaved stereo frames at its own rate into a lock free
+// ring; the callback pulls them through a polyphase resampler at the device
+// rate. The resampling ratio is nudged by up to MAX_RATE_ADJUST to hold the
+// queue near its target depth, so small clock differences between the two
+// never turn into gaps or a growing delay.
+class AudioSink {
+public:
+  AudioSink(uint32_t inputRate, uint32_t outputRate, size_t targetFrames = 2048);
+
+  // Emulation thread. Queues what fits, never blocks; anything dropped counts
+  // as an overrun.
+  size_t push(const int16_t *samples, size_t frames);
+
+  // Audio thread. Always fills `frames` interleaved stereo frames, padding
+  // with silence (and counting an underrun) when the queue runs dry.
+  void pull(int16_t *out, size_t frames);
+
+  inline uint32_t inputRate() const { return rate; }
+  inline size_t queuedFrames() const { return ring.size() / 2; }
+  inline size_t targetFrames() const { return target; }
+  inline uint64_t underruns() const { return underrunCount.load(std::memory_order_relaxed); }
+  inline uint64_t overruns() const { return overrunCount.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr int TAPS = 16;
+  static constexpr int PHASES = 256;
+  // Input frames pulled from the ring at a time
+  static constexpr size_t CHUNK = 512;
+  static constexpr double MAX_RATE_ADJUST = 0.005;
+
+  SpscRing<int16_t> ring;
+  uint32_t rate;
+  size_t target;
+  double baseStep;
+  std::vector<std::array<float, TAPS>> kernel;
+
+  // Consumer state: planar input history, and the read position in it
+  std::vector<float> historyLeft;
+  std::vector<float> historyRight;
+  size_t filled = 0;
+  double position = 0;
+  bool starved = true;
+  std::array<int16_t, CHUNK * 2> chunk{};
+
+  std::atomic<uint64_t> underrunCount{0};
+  std::atomic<uint64_t> overrunCount{0};
+
+  bool refill();
+};
+
+// Steady sine wave, for checking the output path without a game
+class ToneSource {
+public:
+  ToneSource(uint32_t sampleRate, double frequency, int16_t amplitude = 8000);
+  void generate(int16_t *out, size_t frames);
+
+private:
+  double step;
+  double phase = 0;
+  int16_t amplitude;
+};
+
+#endif //PGB_AUDIOSINK_HPP
@@ -0,0 +1,59 @@
+#ifndef PGB_BLIPBUFFER_HPP
+#define PGB_BLIPBUFFER_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <vector>
+
+// Band-limited synthesis buffer. Sound is described as a series of amplitude
+// steps at clock times; each step is added as a windowed-sinc impulse at its
+// exact sub-sample position and the buffer is integrated on read. The cost
+// is per amplitude change and per output sample, never per input clock.
+class BlipBuffer {
+public:
+  // capacity is in output samples, rounded up to a power of two
+  BlipBuffer(uint64_t clockRate, uint32_t sampleRate, size_t capacity);
+
+  // Adds a step to the left and right amplitude at an absolute clock
+  void addDelta(uint64_t clock, int32_t left, int32_t right);
+
+  // Samples that are final once every step before `clock` has been added
+  size_t available(uint64_t clock) const;
+  // Reads up to `frames` interleaved left/right samples
+  size_t read(int16_t *out, size_t frames, uint64_t clock);
+  // Drops the oldest `frames` samples
+  void discard(size_t frames);
+  // Drops everything and restarts silent at `clock`
+  void reset(uint64_t clock);
+
+  inline uint32_t sampleRate() const { return rate; }
+
+private:
+  static constexpr int PHASE_BITS = 6;
+  static constexpr int PHASES = 1 << PHASE_BITS;
+  static constexpr int HALF_WIDTH = 8;
+  static constexpr int TAPS = HALF_WIDTH * 2;
+  static constexpr int DELTA_BITS = 15;
+  // Leaky integrator, removes DC (roughly a 15 Hz high-pass at 48 kHz)
+  static constexpr int BASS_SHIFT = 9;
+  // Clock to sample position, in samples with FRACTION_BITS of fraction
+  static constexpr int FRACTION_BITS = 20;
+
+  uint32_t rate;
+  uint64_t factor;
+  std::array<std::array<int32_t, TAPS>, PHASES> kernel{};
+  std::vector<int32_t> left;
+  std::vector<int32_t> right;
+  size_t mask;
+  // Absolute index of the next sample to read
+  uint64_t readIndex = 0;
+  int32_t leftSum = 0;
+  int32_t rightSum = 0;
+
+  inline uint64_t position(uint64_t clock) const { return clock * factor; }
+  template<bool output>
+  void integrate(int16_t *out, size_t frames);
+};
+
+#endif //PGB_BLIPBUFFER_HPP
@@ -83,8 +83,9 @@ public:
     }
   }
 
-  inline void clock(uint8_t cycles) { _clock += cycles; }
-  inline uint64_t clock() { return _clock; }
+  // The master clock lives in the MMU so bus events (DMA) can be timed against it
+  inline void clock(uint8_t cycles) { mmu->clock += cycles; }
+  inline uint64_t clock() { return mmu->clock; }
 
   inline uint8_t pcRead8() {
     uint8_t value = read8(pc());
@@ -122,6 +123,12 @@ public:
 
   void emulateInstruction();
 
+  inline bool halted() const { return _halted; }
+  void halt();
+  // While halted with nothing pending, jumps the clock straight to `clock`
+  // (typically the GPU's next event) instead of idling 4 cycles at a time
+  void haltUntil(uint64_t clock);
+
   void freeze();
 
   void enableInterrupts();
@@ -130,6 +137,7 @@ public:
   std::array<uint64_t, 256> instrUsages{};
 private:
   void initializeRegisters();
+  void serviceInterrupt(uint8_t pending);
 
   std::shared_ptr<MMU> mmu;
 
@@ -140,7 +148,7 @@ private:
   uint16_t _sp = 0xFFFE;
   uint16_t _pc = 0x0100;
 
-  uint64_t _clock = 0;
+  bool _halted = false;
 
   uint16_t last_clock_m = 0;
   uint16_t last_clock_t = 0;
@@ -0,0 +1,42 @@
+#ifndef PGB_FRAMEPACER_HPP
+#define PGB_FRAMEPACER_HPP
+
+#include <cstdint>
+#include <chrono>
+#include "AudioSink.hpp"
+
+// Keeps emulation in step with real time. With an audio sink at normal
+// speed the sound device is the clock: the emulator waits while more audio
+// is queued than the sink wants, so video and audio can never drift apart.
+// Otherwise the emulated clock is held against a steady host timer, scaled
+// by the speed multiplier.
+class FramePacer {
+public:
+  explicit FramePacer(const AudioSink *audio = nullptr);
+
+  // 1 for normal speed, above 1 to fast forward, below 1 for slow motion.
+  // 0 runs uncapped.
+  void setSpeed(double multiplier);
+  inline double speed() const { return multiplier; }
+  // Whether the audio device is currently driving the pace
+  inline bool audioClocked() const { return audio != nullptr && multiplier == 1.0; }
+
+  // Blocks until the host has caught up with emulated `clock`
+  void waitUntil(uint64_t clock);
+
+private:
+  using Clock = std::chrono::steady_clock;
+  // Falling further behind than this is not made up; the timer restarts
+  static constexpr std::chrono::milliseconds MAX_LAG{100};
+
+  const AudioSink *audio;
+  double multiplier = 1.0;
+  bool started = false;
+  Clock::time_point startTime;
+  uint64_t startClock = 0;
+
+  void waitForAudio();
+  void restart(uint64_t clock);
+};
+
+#endif //PGB_FRAMEPACER_HPP
@@ -2,7 +2,14 @@
 #define PGB_GPU_HPP
 
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "MMU.hpp"
+#include "SpscRing.hpp"
+#include "VideoMemory.hpp"
 
 constexpr uint64_t LINE_WIDTH = 160;
 constexpr uint64_t LINES = 144;
@@ -12,12 +19,20 @@ constexpr uint64_t CLOCK_SCANLINE_HBLANK = 204;
 constexpr uint64_t CLOCK_SCANLINE = CLOCK_SCANLINE_OAM + CLOCK_SCANLINE_VRAM + CLOCK_SCANLINE_HBLANK;
 constexpr uint64_t CLOCK_VBLANK = CLOCK_SCANLINE * 10;
 constexpr uint64_t CLOCK_FRAME = LINES * CLOCK_SCANLINE + CLOCK_VBLANK;
+constexpr uint8_t OAM_SPRITES = 40;
+constexpr uint8_t SPRITES_PER_LINE = 10;
 
 struct GPU_PALETTE_ENTRY {
   uint16_t color;
   inline uint8_t r() { return (color >> 10) & 0x1F; }
   inline uint8_t g() { return (color >> 5) & 0x1F; }
   inline uint8_t b() { return color & 0x1F; }
+  inline uint32_t argb8888() {
+    return 0xFF000000u
+           | static_cast<uint32_t>(r() << 3 | r() >> 2) << 16
+           | static_cast<uint32_t>(g() << 3 | g() >> 2) << 8
+           | static_cast<uint32_t>(b() << 3 | b() >> 2);
+  }
   static inline GPU_PALETTE_ENTRY rgb(uint8_t r, uint8_t g, uint8_t b) {
     return GPU_PALETTE_ENTRY{
       .color=static_cast<uint16_t>((r & 0x1F) << 10 | (g & 0x1F) << 5 | (b & 0x1F))
@@ -29,10 +44,132 @@ struct GPU_PALETTE {
   GPU_PALETTE_ENTRY entries[4];
 };
 
+enum class GPU_OUTPUT_FORMAT {
+  /** 2 bytes per pixel, xRRRRRGGGGGBBBBB (the original output) */
+  RGB555,
+  /** 4 bytes per pixel, 0xAARRGGBB in native byte order */
+  ARGB8888,
+  /** 1 byte per pixel, raw shade index 0-3 (CGB: palette slot, see vsyncBuffer) */
+  INDEX8,
+  /** 2 bits per pixel, 4 pixels per byte with the leftmost pixel in the high bits (CGB: color number only) */
+  INDEX2
+};
+
+// Bytes per output line, for a given output format
+constexpr size_t outputStride(GPU_OUTPUT_FORMAT format) {
+  return format == GPU_OUTPUT_FORMAT::RGB555 ? LINE_WIDTH * 2
+         : format == GPU_OUTPUT_FORMAT::ARGB8888 ? LINE_WIDTH * 4
+         : format == GPU_OUTPUT_FORMAT::INDEX8 ? LINE_WIDTH
+         : LINE_WIDTH / 4;
+}
+
+// Area averaging weights for resampling one axis: output i reads `count[i]`
+// source pixels from `first[i]`, with weights (in 1/256ths, summing to 256)
+// starting at `weights[offset[i]]`
+struct GPU_RESAMPLE_AXIS {
+  size_t size = 0;
+  std::vector<uint16_t> first;
+  std::vector<uint16_t> count;
+  std::vector<uint16_t> offset;
+  std::vector<uint16_t> weights;
+};
+
 class GPU {
 public:
-  explicit GPU(std::shared_ptr<MMU> mmu);
-  void update(uint64_t clockDelta);
+  // A threaded GPU keeps timing, interrupts and VRAM/OAM locking on the calling
+  // thread but draws lines on its own thread, from a copy of video memory fed
+  // with the writes the MMU records. Rendering runs at most one frame behind.
+  explicit GPU(std::shared_ptr<MMU> mmu, GPU_OUTPUT_FORMAT format = GPU_OUTPUT_FORMAT::RGB555, bool threaded = false);
+  ~GPU();
+  GPU(const GPU &) = delete;
+  GPU &operator=(const GPU &) = delete;
+  inline void update(uint64_t clockDelta) { advanceTo(gpuClock + clockDelta); }
+
+  // Runs the GPU up to an absolute clock. Nothing happens between events, so
+  // this is a single compare unless a mode change is due or LCDC.7 was toggled.
+  inline void advanceTo(uint64_t clock) {
+    gpuClock = clock;
+    if (gpuClock >= nextEventClock || mmu->lcdPower() != lcdOn) {
+      step();
+    }
+  }
+
+  // Absolute clock of the next mode change, which is the earliest point a
+  // VBlank or STAT interrupt can be raised. UINT64_MAX while the LCD is off.
+  inline uint64_t nextEvent() const { return nextEventClock; }
+
+  inline GPU_OUTPUT_FORMAT outputFormat() const { return format; }
+  inline size_t frameStride() const { return outputStride(format); }
+  inline size_t frameSize() const { return outputStride(format) * LINES; }
+  inline uint64_t frameCount() const { return completedFrames.load(std::memory_order_acquire); }
+  // VBlanks entered so far. Unlike frameCount() this never lags behind a
+  // render thread, so it marks frame edges for the emulation loop.
+  inline uint64_t vblankCount() const { return vblanks; }
+  inline bool isThreaded() const { return threaded; }
+  // 64 bit hash of the last completed frame, combined from line hashes taken as
+  // each line is drawn (of vsyncBuffer, or the resolved colors for CGB color
+  // formats). Equal frames have equal hashes.
+  inline uint64_t lastFrameHash() const { return vsyncHash.load(std::memory_order_acquire); }
+
+  // Last completed frame in the configured output format. Color formats are
+  // expanded from vsyncBuffer on the first call after each vsync.
+  const uint8_t *frame();
+
+  // Keeps the last `depth` completed frames in the output format, for agents that
+  // look at stacked frames. 0 (the default) turns this off.
+  void setFrameStackDepth(size_t depth);
+  // Calls f(frames, depth) with the last `depth` frames back to back, oldest
+  // first, frameSize() bytes each, and returns true; false while the stack is
+  // off. Each frame is expanded once as it completes, so this copies nothing.
+  // Frames not completed yet read as zero. The pointer is only valid inside f,
+  // which runs under the vsync lock.
+  template<typename F>
+  bool withFrameStack(F f) {
+    std::lock_guard<std::mutex> lock(vsyncMutex);
+    if (stackDepth == 0) {
+      return false;
+    }
+    f(static_cast<const uint8_t *>(&frameStackBuffer[stackHead * frameSize()]), stackDepth);
+    return true;
+  }
+
+  // Only lines [top, bottom) and columns [left, right) are drawn; the rest of
+  // the framebuffer keeps whatever it last held. Timing is unaffected.
+  void setRegionOfInterest(uint8_t top, uint8_t bottom, uint8_t left, uint8_t right);
+  inline void clearRegionOfInterest() { setRegionOfInterest(0, LINES, 0, LINE_WIDTH); }
+
+  // Writes the last completed frame into dst as a width x height grayscale image
+  // (one byte per pixel, 255 is white), area averaging the shade intensities.
+  // CGB frames use the color number as the shade. 80x72 has a SIMD fast path.
+  void renderObservation(uint8_t *dst, size_t width, size_t height);
+
+  // Calls f(line, data, bytes) for each line of the last completed frame that
+  // differs from what the previous call reported (every line on the first
+  // call), with data pointing into frame()'s output. Frames completed between
+  // calls are never missed. Lines are compared by hash, so unchanged lines cost
+  // nothing to skip.
+  template<typename F>
+  void forEachChangedLine(F f) {
+    std::lock_guard<std::mutex> lock(vsyncMutex);
+    const uint8_t *data = expandFrame();
+    size_t stride = frameStride();
+    for (uint8_t line = 0; line < LINES; line++) {
+      if (!reportedLines[line] || reportedLineHashes[line] != vsyncLineHashes[line]) {
+        f(line, data + line * stride, stride);
+        reportedLineHashes[line] = vsyncLineHashes[line];
+        reportedLines[line] = true;
+      }
+    }
+  }
+
+  // Called by the MMU for every VRAM, OAM and palette RAM write while this GPU is threaded
+  inline void recordVideoWrite(GPU_COMMAND_TYPE type, uint16_t offset, uint8_t value) {
+    GPU_COMMAND command{};
+    command.type = type;
+    command.offset = offset;
+    command.value = value;
+    submit(command, false);
+  }
 public:
 //  static inline GPU_MODE mode(uint64_t clock) {
 //    uint64_t frame_clock = clock % FRAME;
@@ -106,13 +243,128 @@ public:
     return (mortonTable[a] << 1) | mortonTable[b];
   }
 
-  std::array<GPU_PALETTE_ENTRY, LINES * LINE_WIDTH> vsyncBuffer{};
-  std::array<GPU_PALETTE_ENTRY, LINES * LINE_WIDTH> framebuffer{};
+  // One byte per pixel. DMG: shade index 0-3. CGB: palette slot, (palette << 2 | color)
+  // with palettes 0-7 for the background and 8-15 for sprites.
+  // Written by the render thread when threaded; read it through frame() then.
+  std::array<uint8_t, LINES * LINE_WIDTH> vsyncBuffer{};
+  std::array<uint8_t, LINES * LINE_WIDTH> framebuffer{};
 
 private:
   std::shared_ptr<MMU> mmu;
   uint64_t gpuClock = 0;
+  uint64_t nextEventClock = 0;
+  uint64_t vblanks = 0;
+  bool lcdOn = false;
+  void step();
+  GPU_OUTPUT_FORMAT format;
+  bool cgbMode;
+  std::vector<uint8_t> output;
+  // CGB frames in a color format, resolved per line since palette RAM can change
+  // mid frame. Copied to vsyncColors at vsync.
+  std::vector<uint8_t> colorbuffer;
+  std::vector<uint8_t> vsyncColors;
+  std::atomic<uint64_t> completedFrames{0};
+  // XXH64 of each framebuffer line, and of those for the last completed frame
+  std::array<uint64_t, LINES> lineHashes{};
+  std::atomic<uint64_t> vsyncHash{0};
+  // Line hashes of the last completed frame, and of the lines forEachChangedLine() last reported
+  std::array<uint64_t, LINES> vsyncLineHashes{};
+  std::array<uint64_t, LINES> reportedLineHashes{};
+  std::array<bool, LINES> reportedLines{};
+  // frame() without taking vsyncMutex
+  const uint8_t *expandFrame();
+  // Writes the last completed frame to dst in the output format
+  void expandInto(uint8_t *dst);
+  // 2 * depth frame slots; slot i + depth mirrors slot i. stackHead is the oldest frame.
+  std::vector<uint8_t> frameStackBuffer;
+  size_t stackDepth = 0;
+  size_t stackHead = 0;
+  GPU_RESAMPLE_AXIS observationColumns;
+  GPU_RESAMPLE_AXIS observationRows;
+  uint64_t outputFrame = UINT64_MAX;
+  // Guards vsyncBuffer/vsyncColors between writeToVsyncBuffer() and frame()
+  std::mutex vsyncMutex;
+
+  // Video memory the renderer reads: the MMU's own, or the render thread's copy
+  VideoMemory *mem;
+  // LCD registers of the line being drawn
+  GPU_LINE_REGISTERS regs{};
+
+  // Threaded mode. The emulation thread queues video memory writes, lines and
+  // frame ends in order; the render thread replays them into `shadow`.
+  bool threaded;
+  std::unique_ptr<SpscRing<GPU_COMMAND>> commands;
+  std::unique_ptr<VideoMemory> shadow;
+  std::thread renderThread;
+  std::atomic<bool> running{false};
+  std::atomic<bool> renderIdle{false};
+  std::mutex wakeMutex;
+  std::condition_variable wake;
+  uint64_t framesSubmitted = 0;
+  std::mutex frameMutex;
+  std::condition_variable frameDone;
+  void submit(const GPU_COMMAND &command, bool notify);
+  void wakeRenderer();
+  void renderLoop();
+  void execute(const GPU_COMMAND &command);
+  void finishFrame();
+  // Sprites visible on each line, in OAM order and capped at 10 like the
+  // hardware. Rebuilt from OAM once per frame or when OAM changes.
+  std::array<std::array<uint8_t, SPRITES_PER_LINE>, LINES> lineSprites{};
+  std::array<uint8_t, LINES> lineSpriteCount{};
+  uint8_t spriteListHeight = 0;
+  // Palette LUTs, rebuilt only when the palettes change.
+  // DMG: color number -> shade index for BGP, OBP0 and OBP1, built from shadeKey
+  std::array<std::array<uint8_t, 4>, 3> dmgShades{};
+  uint32_t shadeKey = UINT32_MAX;
+  // CGB: color number -> output format color, 8 BG palettes followed by 8 OBJ palettes
+  std::array<std::array<uint32_t, 4>, 16> cgbColors{};
+  // 256x256 images of the two tile maps, for each of the two tileset addressing
+  // modes (index map * 2 + tileset). Built on first use and then only redrawn
+  // cell by cell as the MMU reports map and tile writes.
+  std::array<std::array<uint8_t, 256 * 256>, 4> bgLayers{};
+  std::array<bool, 4> layerValid{};
+  // Reverse index per layer: the cells showing each tile, as doubly linked
+  // lists threaded through the cells, so a tile write only redraws its users
+  static constexpr uint16_t NO_CELL = 0xFFFF;
+  std::array<std::array<uint16_t, 768>, 4> tileCells{};
+  std::array<std::array<uint16_t, 32 * 32>, 4> cellTile{};
+  std::array<std::array<uint16_t, 32 * 32>, 4> nextCell{};
+  std::array<std::array<uint16_t, 32 * 32>, 4> prevCell{};
+  void linkCell(int index, uint16_t cell, uint16_t tile);
+  void unlinkCell(int index, uint16_t cell);
+  template<bool cgb>
+  const uint8_t *layer(uint8_t map, uint8_t tileset);
+  template<bool cgb>
+  void updateLayers();
+  template<bool cgb>
+  uint16_t layerTile(int index, uint16_t cell);
+  template<bool cgb>
+  void drawLayerCell(int index, uint16_t cell);
+  static void copyLayerRow(uint8_t *dst, int start, int end, const uint8_t *layer, uint8_t x, uint8_t y);
+
+  // Internal window line counter; only advances on lines that draw the window
+  uint8_t windowLine = 0;
+  // top | bottom << 8 | left << 16 | right << 24, read by the render thread
+  std::atomic<uint32_t> regionOfInterest{LINES << 8u | LINE_WIDTH << 24u};
+
+  void renderLine(const GPU_LINE_REGISTERS &registers);
+  // DMG and CGB are separate instantiations so DMG frames never touch map attributes
+  template<bool cgb>
   void renderLine();
+  template<bool cgb>
+  // Both only touch columns [start, end)
+  void renderSprites(const uint8_t *bg, uint8_t *out, int start, int end);
+  void writeColorLine(const uint8_t *slots, int start, int end);
+  void buildSpriteLists();
+  void updateShades();
+  void updateColors();
+
+  // Interleaves the two bitplanes of one tile row; pixel 0 ends up in the top two bits
+  inline uint16_t tileRow(uint8_t bank, uint16_t tileAddr, uint8_t row) {
+    const uint8_t *data = &mem->vram[bank][tileAddr + row * 2];
+    return interleave(data[1], data[0]);
+  }
   void writeToVsyncBuffer();
 };
 
@@ -0,0 +1,47 @@
+#ifndef PGB_GAMEBOY_HPP
+#define PGB_GAMEBOY_HPP
+
+#include <cstdint>
+#include <memory>
+#include "ROM.hpp"
+#include "MMU.hpp"
+#include "CPU.hpp"
+#include "GPU.hpp"
+
+// One complete machine and the frame loop the frontends run by hand, for
+// tooling that steps the emulator a frame at a time
+class GameBoy {
+public:
+  explicit GameBoy(std::shared_ptr<ROM> rom, GPU_OUTPUT_FORMAT format = GPU_OUTPUT_FORMAT::RGB555, bool threadedGpu = false);
+
+  std::shared_ptr<ROM> rom;
+  std::shared_ptr<MMU> mmu;
+  std::shared_ptr<CPU> cpu;
+  std::shared_ptr<GPU> gpu;
+
+  inline uint64_t clock() const { return mmu->clock; }
+  inline uint64_t frame() const { return mmu->clock / CLOCK_FRAME; }
+
+  // Emulates until the clock reaches `target`, or stop() is called
+  void runUntil(uint64_t target);
+  // Makes the runUntil() in progress return after the current instruction
+  inline void stop() { stopRequested = true; }
+  // Emulates up to the next VBlank, or for CLOCK_FRAME cycles while the LCD is
+  // off, so a frame is always one displayed frame whatever the LCD did before
+  void runFrame();
+  // Runs frames until one reads the joypad, at most `maxFrames`. Returns how
+  // many frames ran; the last one is the one that polled unless lagged().
+  uint64_t runUntilInputPolled(uint64_t maxFrames = 600);
+
+  // Whether the last frame run never read the joypad
+  inline bool lagged() const { return lastFrameLagged; }
+  inline uint64_t lagFrames() const { return lagFrameCount; }
+
+private:
+  bool stopRequested = false;
+  void step(uint64_t limit);
+  bool lastFrameLagged = false;
+  uint64_t lagFrameCount = 0;
+};
+
+#endif //PGB_GAMEBOY_HPP
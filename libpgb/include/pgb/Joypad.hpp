@@ -0,0 +1,60 @@
+#ifndef PGB_JOYPAD_HPP
+#define PGB_JOYPAD_HPP
+
+#include <cstdint>
+#include <deque>
+
+// Button bits for Joypad::queue, set = pressed
+constexpr uint8_t JOYPAD_RIGHT = 0x01u;
+constexpr uint8_t JOYPAD_LEFT = 0x02u;
+constexpr uint8_t JOYPAD_UP = 0x04u;
+constexpr uint8_t JOYPAD_DOWN = 0x08u;
+constexpr uint8_t JOYPAD_A = 0x10u;
+constexpr uint8_t JOYPAD_B = 0x20u;
+constexpr uint8_t JOYPAD_SELECT = 0x40u;
+constexpr uint8_t JOYPAD_START = 0x80u;
+
+struct JOYPAD_EVENT {
+  uint64_t clock;
+  uint8_t buttons;
+};
+
+// The P1/JOYP register (FF00). Input is not polled from the host: callers
+// queue button states stamped with the cycle they take effect, and the MMU
+// applies them when the CPU gets there, so the same queue always produces
+// the same run.
+class Joypad {
+public:
+  // The full button state from `clock` on. Events may be queued in any order.
+  void queue(uint64_t clock, uint8_t buttons);
+  // State after everything queued so far, for building the next event
+  inline uint8_t queuedButtons() const { return events.empty() ? buttons : events.back().buttons; }
+  inline uint8_t pressed() const { return buttons; }
+  inline uint64_t nextEvent() const { return events.empty() ? UINT64_MAX : events.front().clock; }
+
+  // Whether the game has read FF00 since the last clearPolled(). A frame
+  // without a read is a lag frame: no input given during it can matter.
+  inline bool polled() const { return wasPolled; }
+  inline void clearPolled() { wasPolled = false; }
+
+  // Applies every event due by `clock`. True if an input line fell, which
+  // requests the joypad interrupt.
+  bool update(uint64_t clock);
+
+  uint8_t read() const;
+  // Selects the button group(s); also true if that pulls an input line low
+  bool write(uint8_t value);
+
+private:
+  std::deque<JOYPAD_EVENT> events;
+  uint8_t buttons = 0;
+  // P14/P15, low selects directions/actions
+  uint8_t selectBits = 0;
+  // Set from read(), which the MMU calls from its const register read path
+  mutable bool wasPolled = false;
+
+  // P10-P13, low = pressed in a selected group
+  uint8_t lines() const;
+};
+
+#endif //PGB_JOYPAD_HPP
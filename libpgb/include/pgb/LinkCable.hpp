@@ -0,0 +1,34 @@
+#ifndef PGB_LINKCABLE_HPP
+#define PGB_LINKCABLE_HPP
+
+#include <cstdint>
+#include <memory>
+#include "GameBoy.hpp"
+
+// Two machines in one process, joined at their serial ports. They take turns
+// running a window of cycles each instead of handshaking per instruction.
+// A window is one byte time at the clock SC currently selects, so a transfer
+// started inside one can't complete before the next, and it always ends
+// exactly on a pending transfer so both sides swap bytes at the same cycle.
+// An SC write that starts a faster transfer ends the window early.
+class LinkCable {
+public:
+  LinkCable(std::shared_ptr<GameBoy> first, std::shared_ptr<GameBoy> second);
+  ~LinkCable();
+  LinkCable(const LinkCable &) = delete;
+  LinkCable &operator=(const LinkCable &) = delete;
+
+  std::shared_ptr<GameBoy> first;
+  std::shared_ptr<GameBoy> second;
+
+  // Runs both machines until both clocks reach `clock`
+  void runUntil(uint64_t clock);
+  // Runs both machines to the next frame boundary
+  void runFrame();
+
+private:
+  // End of the window being run
+  uint64_t windowEnd = 0;
+};
+
+#endif //PGB_LINKCABLE_HPP
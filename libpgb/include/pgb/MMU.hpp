@@ -1,10 +1,15 @@
 #ifndef PGB_MMU_HPP
 #define PGB_MMU_HPP
 
+#include <algorithm>
 #include <cstdint>
 #include <memory>
 #include <array>
 #include "ROM.hpp"
+#include "APU.hpp"
+#include "Joypad.hpp"
+#include "Serial.hpp"
+#include "VideoMemory.hpp"
 #include "gb_mode.hpp"
 
 #define RECORD_MEMORY 0
@@ -27,6 +32,18 @@ struct MemoryMap {
   }
 };
 
+// Interrupt request/enable bits, in priority order
+constexpr uint8_t INTERRUPT_VBLANK = 0x01u;
+constexpr uint8_t INTERRUPT_LCD_STAT = 0x02u;
+constexpr uint8_t INTERRUPT_TIMER = 0x04u;
+constexpr uint8_t INTERRUPT_SERIAL = 0x08u;
+constexpr uint8_t INTERRUPT_JOYPAD = 0x10u;
+
+// OAM DMA keeps the bus busy for 160 M-cycles
+constexpr uint64_t CLOCK_OAM_DMA = 640;
+// CGB HDMA/GDMA halts the CPU for 8 M-cycles per 16 byte block
+constexpr uint64_t CLOCK_HDMA_BLOCK = 32;
+
 enum class GPU_MODE {
   SCAN_OAM = 2,
   SCAN_VRAM = 3,
@@ -39,6 +56,8 @@ enum class BACKGROUND_MODE {
   WINDOW
 };
 
+class GPU;
+
 class MMU {
 public:
   using ROM0 = MemoryMap<0x0000, 0x3FFF>;
@@ -59,10 +78,40 @@ public:
   explicit MMU(std::shared_ptr<ROM> rom);
 
   std::shared_ptr<ROM> rom;
+  // Sound registers FF10-FF3F are forwarded here, stamped with the master clock
+  std::shared_ptr<APU> apu;
 
   uint8_t read8(uint16_t addr);
   void write8(uint16_t addr, uint8_t value);
 
+  // Master clock in cycles, advanced by the CPU
+  uint64_t clock = 0;
+  // Runs bus events (the end of OAM DMA) that are due. Called once per instruction.
+  inline void update() {
+    if (clock >= nextEventClock) {
+      runEvents();
+    }
+  }
+  inline uint64_t nextEvent() const { return nextEventClock; }
+  // Makes sure runEvents() happens once the clock reaches `at`, for state
+  // changed from outside the MMU (input, a linked serial port)
+  inline void scheduleEvent(uint64_t at) { nextEventClock = std::min(nextEventClock, at); }
+
+  // Button state (JOYPAD_* bits) taking effect once the clock reaches `at`
+  void queueInput(uint64_t at, uint8_t buttons);
+  Joypad joypad;
+  Serial serial;
+
+  // Called by the GPU on entering HBlank; moves one block of an active HBlank DMA
+  inline void enterHblank() {
+    if (hdmaActive) {
+      hdmaBlock();
+    }
+  }
+
+  // Mode changes go through here so VRAM/OAM access can be remapped
+  void setGpuMode(GPU_MODE mode);
+
   uint8_t oamread(uint16_t addr);
   uint8_t vramread(uint16_t addr);
   uint8_t vram2read(uint16_t addr);
@@ -73,6 +122,7 @@ public:
   uint8_t wram_bank{1};
   uint8_t vram_bank{0};
   uint8_t interrupt_enable = 0;
+  uint8_t interrupt_flag = 0;
   bool interrupts_enabled = false;
   GBMode model = GBMode::GB;
   bool gbcMode = false;
@@ -84,12 +134,34 @@ public:
   uint64_t gpu_line = 0;
   uint8_t scrollX;
   uint8_t scrollY;
+  uint8_t windowY = 0;
+  uint8_t windowX = 0;
   uint8_t lcdControl = 0x80u;
   bool lycCheckEnable = false;
   uint8_t lycCompare = 0;
   bool mode2OamCheckEnable = false;
   bool mode1VblankCheckEnable = false;
   bool mode0HblankCheckEnable = false;
+  bool statLine = false;
+  uint8_t bgPalette = 0xFC;
+  uint8_t objPalette0 = 0xFF;
+  uint8_t objPalette1 = 0xFF;
+  // CGB BCPS/OCPS
+  uint8_t bgPaletteIndex = 0;
+  uint8_t objPaletteIndex = 0;
+  // VRAM, OAM and CGB palette RAM, with the dirty flags the GPU consumes
+  VideoMemory video;
+
+  // While set, every video memory write is also handed to `gpu` so its render
+  // thread can replay it into its own copy. nullptr to stop.
+  void recordVideoWrites(GPU *gpu);
+  GPU_LINE_REGISTERS lineRegisters() const;
+
+  inline void requestInterrupt(uint8_t interrupt) { interrupt_flag |= interrupt; }
+  inline uint8_t pendingInterrupts() const { return interrupt_enable & interrupt_flag & 0x1Fu; }
+  // Re-evaluates the STAT interrupt line and requests LCD_STAT on its rising edge.
+  // Called by the GPU on mode/line changes and on STAT/LYC writes.
+  void updateStat();
 
   inline bool interrupt_joypad() { return (interrupt_enable & 0x10u) != 0; }
   inline bool interrupt_serial() { return (interrupt_enable & 0x8u) != 0; }
@@ -112,13 +184,71 @@ public:
   #endif
 
 private:
-  std::array<uint8_t, VRAM::size> vram{};
-  std::array<uint8_t, VRAM::size> vram2{};
+  using ReadHandler = uint8_t (MMU::*)(uint16_t addr);
+  using WriteHandler = void (MMU::*)(uint16_t addr, uint8_t value);
+
+  // One read and one write handler per 256 byte page
+  std::array<ReadHandler, 256> readHandlers{};
+  std::array<WriteHandler, 256> writeHandlers{};
+
+  template<typename Region>
+  inline void mapRegion(ReadHandler read, WriteHandler write) {
+    for (int page = Region::start >> 8u; page <= Region::end >> 8u; page++) {
+      readHandlers[page] = read;
+      writeHandlers[page] = write;
+    }
+  }
+  void mapMemory();
+  void updateAccessLocks();
+
+  uint64_t nextEventClock = UINT64_MAX;
+  void runEvents();
+  // OAM DMA: the last FF46 value, and when the bus is released again
+  uint8_t dmaSource = 0xFF;
+  bool dmaActive = false;
+  uint64_t dmaEndClock = 0;
+  void startOamDma(uint8_t source);
+  const uint8_t *directRead(uint16_t addr);
+  // CGB VRAM DMA (FF51-FF55): source and VRAM destination advance as blocks are
+  // copied; hdmaControl is what FF55 reads back
+  uint16_t hdmaSource = 0;
+  uint16_t hdmaDest = 0;
+  uint8_t hdmaControl = 0xFF;
+  bool hdmaActive = false;
+  void startVramDma(uint8_t control);
+  void copyVramDmaBlock();
+  void hdmaBlock();
+  uint8_t wramxBank() const;
+
+  uint8_t readLocked(uint16_t addr);
+  void writeLocked(uint16_t addr, uint8_t value);
+  uint8_t readRom(uint16_t addr);
+  void writeRom(uint16_t addr, uint8_t value);
+  uint8_t readVram(uint16_t addr);
+  void writeVram(uint16_t addr, uint8_t value);
+  void writeVramRecorded(uint16_t addr, uint8_t value);
+  uint8_t readSram(uint16_t addr);
+  void writeSram(uint16_t addr, uint8_t value);
+  uint8_t readWram0(uint16_t addr);
+  void writeWram0(uint16_t addr, uint8_t value);
+  uint8_t readWramx(uint16_t addr);
+  void writeWramx(uint16_t addr, uint8_t value);
+  uint8_t readEcho(uint16_t addr);
+  void writeEcho(uint16_t addr, uint8_t value);
+  uint8_t readOam(uint16_t addr);
+  void writeOam(uint16_t addr, uint8_t value);
+  void writeOamRecorded(uint16_t addr, uint8_t value);
+  uint8_t readHigh(uint16_t addr);
+  void writeHigh(uint16_t addr, uint8_t value);
+
+  // Bank selected by VRAM_BANK
+  uint8_t vramBankIndex = 0;
+  GPU *videoRecorder = nullptr;
   std::array<std::array<uint8_t, VRAM::size>, 8> wramx{};
   std::array<uint8_t, HRAM::size> hram{};
-  std::array<uint8_t, 160> oam{};
   void iowrite(uint16_t addr, uint8_t value);
   uint8_t ioread(uint16_t addr) const;
+  void writePaletteRam(GPU_COMMAND_TYPE type, uint8_t &index, uint8_t value);
 };
 
 
@@ -66,12 +66,24 @@ public:
   uint8_t ram_bank = 0x0;
 
 private:
-  std::vector<std::array<uint8_t, BANK_SIZE>> banks;
+  // Start of each bank within the image. The image is never copied per bank:
+  // it is a mapping of the file, the caller's buffer, or one owned vector.
+  std::vector<const uint8_t *> banks;
+  std::vector<uint8_t> storage;
+  void *mapping = nullptr;
+  size_t mappingSize = 0;
+  // A trailing partial bank, padded out to BANK_SIZE
+  std::vector<uint8_t> tail;
   std::array<std::array<uint8_t, SRAM_SIZE>, 4> sram{};
   CART_TYPE cartType;
 
+  ROM() = default;
+  void mapBanks(const uint8_t *data, size_t size);
+
 public:
-  explicit ROM(std::vector<std::array<uint8_t, BANK_SIZE>> banks);
+  ~ROM();
+  ROM(const ROM &) = delete;
+  ROM &operator=(const ROM &) = delete;
 
   uint8_t read(uint16_t offset);
   void write(uint16_t offset, uint8_t value);
@@ -79,10 +91,19 @@ public:
   uint8_t readSram(uint16_t offset);
   void writeSram(uint16_t offset, uint8_t value);
 
-  GBHeader *header();
+  // Backing memory for the currently mapped ROM (0x0000-0x7FFF) or SRAM, valid
+  // up to the end of the bank. SRAM is nullptr while disabled.
+  const uint8_t *romPointer(uint16_t offset);
+  const uint8_t *sramPointer(uint16_t offset);
+
+  const GBHeader *header() const;
 
+  // Memory maps the file where possible (POSIX), so banks are only paged in
+  // as they are touched; reads it into memory otherwise
   static std::shared_ptr<ROM> readRom(FILE *file);
-  static std::shared_ptr<ROM> readRom(std::vector<uint8_t>);
+  static std::shared_ptr<ROM> readRom(std::vector<uint8_t> bytes);
+  // Uses the caller's buffer in place; it must outlive the ROM
+  static std::shared_ptr<ROM> borrowRom(const uint8_t *data, size_t size);
 };
 
 
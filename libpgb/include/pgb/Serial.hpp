@@ -0,0 +1,72 @@
+#ifndef PGB_SERIAL_HPP
+#define PGB_SERIAL_HPP
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Internal clock transfers shift 8 bits at 8192 Hz, or 262144 Hz with the
+// CGB fast clock
+constexpr uint64_t CLOCK_SERIAL_BYTE = 4096;
+constexpr uint64_t CLOCK_SERIAL_BYTE_FAST = 128;
+
+// The serial port (SB/SC, FF01-FF02). A transfer starts on an SC write with
+// bit 7 set and completes a full byte time later, at which point the byte
+// sent is appended to output() and handed to the callback. With nothing
+// connected the incoming byte is 0xFF, and externally clocked transfers
+// never complete. Two ports can be connect()ed: the one driving the clock
+// then swaps bytes with the other when its transfer completes.
+class Serial {
+public:
+  Serial() = default;
+  ~Serial();
+  Serial(const Serial &) = delete;
+  Serial &operator=(const Serial &) = delete;
+
+  uint8_t read(uint16_t addr) const;
+  void write(uint16_t addr, uint8_t value, uint64_t clock);
+
+  // When the transfer in progress completes, UINT64_MAX if none
+  inline uint64_t nextEvent() const { return transferEnd; }
+  // Moves the transfer in progress to complete at `clock` if it was due earlier
+  inline void postpone(uint64_t clock) {
+    if (transferEnd < clock) transferEnd = clock;
+  }
+  // Length of an internally clocked transfer with the clock SC selects now
+  inline uint64_t byteTime() const { return (control & 0x02u) ? CLOCK_SERIAL_BYTE_FAST : CLOCK_SERIAL_BYTE; }
+  // Completes a transfer due by `clock`; true if that requests the serial interrupt
+  bool update(uint64_t clock);
+
+  // Every byte sent so far, for test ROMs that report over serial
+  inline const std::vector<uint8_t> &output() const { return sent; }
+  inline std::string outputText() const { return std::string(sent.begin(), sent.end()); }
+  inline void clearOutput() { sent.clear(); }
+  // Called with each byte as its transfer completes
+  void setCallback(std::function<void(uint8_t)> callback);
+  // Called after every SC write, once the transfer it starts is scheduled
+  void setControlCallback(std::function<void()> callback);
+
+  // Links two ports; pass nullptr to unplug
+  void connect(Serial *other);
+
+  // SC bit 1 selects the fast clock on CGB only
+  bool fastClockAvailable = false;
+
+private:
+  uint8_t data = 0;
+  uint8_t control = 0;
+  uint64_t transferEnd = UINT64_MAX;
+  std::vector<uint8_t> sent;
+  std::function<void(uint8_t)> onByte;
+  std::function<void()> onControl;
+  Serial *peer = nullptr;
+  // Byte shifted out by an externally clocked transfer the peer completed
+  uint8_t shiftedOut = 0;
+
+  // The peer clocked a byte in; returns the byte shifted out in exchange
+  uint8_t clockIn(uint8_t in, uint64_t clock);
+  void finish(uint8_t out);
+};
+
+#endif //PGB_SERIAL_HPP
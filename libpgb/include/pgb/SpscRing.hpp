@@ -0,0 +1,61 @@
+#ifndef PGB_SPSCRING_HPP
+#define PGB_SPSCRING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Lock free single producer/single consumer ring buffer. One thread may
+// write and one other thread may read; neither ever blocks the other.
+template<typename T>
+class SpscRing {
+public:
+  // Capacity is rounded up to a power of two
+  explicit SpscRing(size_t minCapacity) {
+    size_t capacity = 1;
+    while (capacity < minCapacity) capacity <<= 1u;
+    buffer.resize(capacity);
+    mask = capacity - 1;
+  }
+
+  inline size_t capacity() const { return buffer.size(); }
+  inline size_t size() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+  inline bool empty() const { return size() == 0; }
+
+  // Producer side. Writes as many items as fit and returns how many that was.
+  size_t write(const T *items, size_t count) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t free = buffer.size() - (h - tail.load(std::memory_order_acquire));
+    if (count > free) count = free;
+    for (size_t i = 0; i < count; i++) {
+      buffer[(h + i) & mask] = items[i];
+    }
+    head.store(h + count, std::memory_order_release);
+    return count;
+  }
+
+  inline bool push(const T &item) { return write(&item, 1) == 1; }
+
+  // Consumer side. Reads up to `count` items and returns how many were read.
+  size_t read(T *items, size_t count) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t available = head.load(std::memory_order_acquire) - t;
+    if (count > available) count = available;
+    for (size_t i = 0; i < count; i++) {
+      items[i] = buffer[(t + i) & mask];
+    }
+    tail.store(t + count, std::memory_order_release);
+    return count;
+  }
+
+private:
+  std::vector<T> buffer;
+  size_t mask;
+  // Monotonic counters; head is only written by the producer, tail by the
+  // consumer. Padded apart so the two threads don't share a cache line.
+  std::atomic<size_t> head{0};
+  char padding[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail{0};
+};
+
+#endif //PGB_SPSCRING_HPP
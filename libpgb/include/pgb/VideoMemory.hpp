@@ -0,0 +1,131 @@
+#ifndef PGB_VIDEOMEMORY_HPP
+#define PGB_VIDEOMEMORY_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <array>
+
+// Everything the GPU renders from besides the LCD registers: both VRAM banks,
+// OAM and CGB palette RAM, plus dirty flags so the renderer can update its
+// caches incrementally. The MMU owns the real one; the threaded renderer keeps
+// its own copy, replayed from recorded writes.
+struct VideoMemory {
+  std::array<std::array<uint8_t, 0x2000>, 2> vram{};
+  std::array<uint8_t, 160> oam{};
+  // CGB palette RAM, 8 palettes of 4 little endian colors each
+  std::array<uint8_t, 64> bgPaletteRam{};
+  std::array<uint8_t, 64> objPaletteRam{};
+
+  // Tile data (384 tiles per bank, bank 1 at 384) and tile map entries
+  // (attributes included) written since the GPU last updated its background
+  // layers. The flags dedupe; the lists let the update visit only what changed.
+  bool vramDirty = false;
+  std::array<bool, 768> tileDirty{};
+  std::array<bool, 0x800> mapDirty{};
+  std::array<uint16_t, 768> dirtyTiles{};
+  std::array<uint16_t, 0x800> dirtyMapEntries{};
+  uint16_t dirtyTileCount = 0;
+  uint16_t dirtyMapCount = 0;
+  // Set on any OAM write, cleared once the sprite lists have been rebuilt
+  bool oamDirty = true;
+  // Set on any palette RAM write, cleared once the color LUTs have been rebuilt
+  bool paletteDirty = true;
+
+  inline void writeVram(uint8_t bank, uint16_t offset, uint8_t value) {
+    vram[bank][offset] = value;
+    markVram(bank, offset);
+  }
+
+  // Bulk write for HDMA; must not run past the end of the bank
+  inline void writeVramBlock(uint8_t bank, uint16_t offset, const uint8_t *src, uint16_t length) {
+    memcpy(&vram[bank][offset], src, length);
+    for (uint16_t i = offset; i < offset + length; i++) {
+      markVram(bank, i);
+    }
+  }
+
+  inline void markVram(uint8_t bank, uint16_t offset) {
+    if (offset < 0x1800) {
+      uint16_t tile = bank * 384 + offset / 16;
+      if (!tileDirty[tile]) {
+        tileDirty[tile] = true;
+        dirtyTiles[dirtyTileCount++] = tile;
+      }
+    } else {
+      uint16_t entry = offset - 0x1800;
+      if (!mapDirty[entry]) {
+        mapDirty[entry] = true;
+        dirtyMapEntries[dirtyMapCount++] = entry;
+      }
+    }
+    vramDirty = true;
+  }
+
+  inline void clearVramDirty() {
+    for (uint16_t i = 0; i < dirtyTileCount; i++) {
+      tileDirty[dirtyTiles[i]] = false;
+    }
+    for (uint16_t i = 0; i < dirtyMapCount; i++) {
+      mapDirty[dirtyMapEntries[i]] = false;
+    }
+    dirtyTileCount = 0;
+    dirtyMapCount = 0;
+    vramDirty = false;
+  }
+
+  inline void writeOam(uint8_t offset, uint8_t value) {
+    oam[offset] = value;
+    oamDirty = true;
+  }
+
+  inline void writePalette(std::array<uint8_t, 64> &ram, uint8_t offset, uint8_t value) {
+    ram[offset] = value;
+    paletteDirty = true;
+  }
+};
+
+// LCD registers the renderer needs, captured when a line is drawn
+struct GPU_LINE_REGISTERS {
+  uint8_t line;
+  uint8_t lcdControl;
+  uint8_t scrollX;
+  uint8_t scrollY;
+  uint8_t windowX;
+  uint8_t windowY;
+  uint8_t bgPalette;
+  uint8_t objPalette0;
+  uint8_t objPalette1;
+
+  inline bool lcdWindowTiles() const { return (lcdControl & 0x40) != 0; }
+  inline bool lcdWindowEnable() const { return (lcdControl & 0x20) != 0; }
+  inline uint8_t lcdBGWindowTileset() const { return (lcdControl & 0x10) != 0 ? 1 : 0; }
+  inline uint8_t lcdBGTileMap() const { return (lcdControl & 0x8) != 0 ? 1 : 0; }
+  inline uint8_t lcdSpriteSize() const { return (lcdControl & 0x4) != 0 ? 1 : 0; }
+  inline bool lcdSpritesEnabled() const { return (lcdControl & 0x2) != 0; }
+  inline bool bgEnabled() const { return (lcdControl & 0x1) != 0; }
+  // BGP, OBP0 and OBP1 packed into one key
+  inline uint32_t dmgPalettes() const {
+    return bgPalette | static_cast<uint32_t>(objPalette0) << 8u | static_cast<uint32_t>(objPalette1) << 16u;
+  }
+};
+
+enum class GPU_COMMAND_TYPE : uint8_t {
+  VRAM0,
+  VRAM1,
+  OAM,
+  BG_PALETTE,
+  OBJ_PALETTE,
+  LINE,
+  FRAME
+};
+
+// One entry of the threaded renderer's queue: a video memory write, a line to
+// draw, or the end of a frame
+struct GPU_COMMAND {
+  GPU_COMMAND_TYPE type;
+  uint8_t value;
+  uint16_t offset;
+  GPU_LINE_REGISTERS registers;
+};
+
+#endif //PGB_VIDEOMEMORY_HPP
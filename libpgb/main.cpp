@@ -1,12 +1,52 @@
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include "pgb/ROM.hpp"
 #include "pgb/MMU.hpp"
 #include "pgb/CPU.hpp"
 #include "pgb/GPU.hpp"
+#include "pgb/AudioSink.hpp"
+#include "pgb/FramePacer.hpp"
 #include <SDL.h>
 
-int main() {
-  if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+// Keyboard layout for the Game Boy buttons
+static uint8_t joypadButton(SDL_Keycode key) {
+  switch (key) {
+    case SDLK_RIGHT:
+      return JOYPAD_RIGHT;
+    case SDLK_LEFT:
+      return JOYPAD_LEFT;
+    case SDLK_UP:
+      return JOYPAD_UP;
+    case SDLK_DOWN:
+      return JOYPAD_DOWN;
+    case SDLK_x:
+      return JOYPAD_A;
+    case SDLK_z:
+      return JOYPAD_B;
+    case SDLK_RSHIFT:
+      return JOYPAD_SELECT;
+    case SDLK_RETURN:
+      return JOYPAD_START;
+    default:
+      return 0;
+  }
+}
+
+int main(int argc, char **argv) {
+  // --tone plays a test tone in place of the game's sound
+  bool tone = false;
+  // --threaded draws lines on a second thread, at up to a frame of extra latency
+  bool threaded = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--tone") == 0) {
+      tone = true;
+    } else if (strcmp(argv[i], "--threaded") == 0) {
+      threaded = true;
+    }
+  }
+
+  if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
     std::cerr << "Failed to init sdl: " << SDL_GetError() << std::endl;
     return 1;
   }
@@ -24,11 +64,11 @@ int main() {
 //  SDL_FillRect(screenSurface, NULL, SDL_MapRGB(screenSurface->format, 0xFF, 0xFF, 0xFF));
 //  SDL_UpdateWindowSurface(window);
   SDL_Renderer *renderer = SDL_CreateRenderer(
-    window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC
+    window, -1, SDL_RENDERER_ACCELERATED
   );
   SDL_Texture *gbTex = SDL_CreateTexture(
     renderer,
-    SDL_PIXELFORMAT_RGB555, SDL_TEXTUREACCESS_STREAMING,
+    SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
     LINE_WIDTH, LINES
   );
 
@@ -44,16 +84,44 @@ int main() {
   std::shared_ptr<MMU> mmu(new MMU(rom));
 
   CPU cpu(mmu);
-  GPU gpu(mmu);
+  GPU gpu(mmu, GPU_OUTPUT_FORMAT::ARGB8888, threaded);
+
+  // Created once the device rate is known; the device stays paused until then
+  std::unique_ptr<AudioSink> audio;
+  SDL_AudioSpec want{};
+  want.freq = static_cast<int>(mmu->apu->sampleRate());
+  want.format = AUDIO_S16SYS;
+  want.channels = 2;
+  want.samples = 512;
+  want.callback = [](void *userdata, Uint8 *stream, int len) {
+    AudioSink &sink = **static_cast<std::unique_ptr<AudioSink> *>(userdata);
+    sink.pull(reinterpret_cast<int16_t *>(stream), len / (2 * sizeof(int16_t)));
+  };
+  want.userdata = &audio;
+  SDL_AudioSpec have{};
+  // The sink resamples, so take whatever rate the device prefers
+  SDL_AudioDeviceID audioDevice = SDL_OpenAudioDevice(nullptr, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+  if (audioDevice == 0) {
+    std::cerr << "Failed to open audio: " << SDL_GetError() << std::endl;
+  } else {
+    audio.reset(new AudioSink(mmu->apu->sampleRate(), static_cast<uint32_t>(have.freq)));
+    SDL_PauseAudioDevice(audioDevice, 0);
+  }
+  ToneSource toneSource(mmu->apu->sampleRate(), 440);
+  std::array<int16_t, 1024 * 2> samples{};
+  // Hold tab to fast forward, left shift for half speed
+  FramePacer pacer(audio.get());
 
 //  cpu.printState();
   bool quit = false;
   uint64_t frame = 0;
   while (!quit) {
-    uint64_t startClock = cpu.clock();
     cpu.emulateInstruction();
+    if (cpu.halted()) {
+      cpu.haltUntil(std::min({gpu.nextEvent(), mmu->nextEvent(), (frame + 1) * CLOCK_FRAME}));
+    }
     uint64_t endClock = cpu.clock();
-    gpu.update(endClock - startClock);
+    gpu.advanceTo(endClock);
     uint64_t newFrame = endClock / CLOCK_FRAME;
     if (newFrame != frame) {
       frame = newFrame;
@@ -63,6 +131,17 @@ int main() {
       while (SDL_PollEvent(&event)) {
         if (event.type == SDL_QUIT) {
           quit = true;
+        } else if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && !event.key.repeat) {
+          bool down = event.type == SDL_KEYDOWN;
+          uint8_t button = joypadButton(event.key.keysym.sym);
+          if (button != 0) {
+            uint8_t buttons = mmu->joypad.queuedButtons();
+            mmu->queueInput(endClock, down ? buttons | button : buttons & ~button);
+          } else if (event.key.keysym.sym == SDLK_TAB) {
+            pacer.setSpeed(down ? 0 : 1);
+          } else if (event.key.keysym.sym == SDLK_LSHIFT) {
+            pacer.setSpeed(down ? 0.5 : 1);
+          }
         }
         // Ignore other events
       }
@@ -70,7 +149,7 @@ int main() {
       SDL_UpdateTexture(
         gbTex,
         nullptr,
-        gpu.vsyncBuffer.data(), LINE_WIDTH * 2
+        gpu.frame(), gpu.frameStride()
       );
 
       SDL_RenderClear(renderer);
@@ -79,10 +158,24 @@ int main() {
         gbTex, nullptr, nullptr
       );
       SDL_RenderPresent(renderer);
-      SDL_Delay(16);
+
+      size_t count;
+      while ((count = mmu->apu->readSamples(samples.data(), samples.size() / 2, endClock)) > 0) {
+        if (tone) {
+          toneSource.generate(samples.data(), count);
+        }
+        // Off speed audio would only overrun the sink
+        if (audio && pacer.audioClocked()) {
+          audio->push(samples.data(), count);
+        }
+      }
+      pacer.waitUntil(endClock);
     }
   }
 
+  // Test ROMs report their results over serial
+  std::cout << mmu->serial.outputText() << std::endl;
+
   for (int i = 0; i < cpu.instrUsages.size(); i++) {
     int usage = cpu.instrUsages[i];
     if (usage > 0) {
@@ -100,6 +193,10 @@ int main() {
   }
   #endif
 
+  if (audioDevice != 0) {
+    SDL_CloseAudioDevice(audioDevice);
+    std::cout << "audio underruns " << audio->underruns() << ", overruns " << audio->overruns() << std::endl;
+  }
   SDL_DestroyWindow(window);
   SDL_Quit();
 
@@ -0,0 +1,351 @@
+#include "../../include/pgb/APU.hpp"
+
+#include <algorithm>
+
+namespace {
+  // Bits that always read back as 1, FF10-FF2F
+  const uint8_t READ_MASK[0x20] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF, // NR10-NR14
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF, // NR20-NR24
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF, // NR30-NR34
+    0xFF, 0xFF, 0x00, 0x00, 0xBF, // NR40-NR44
+    0x00, 0x00, 0x70,             // NR50-NR52
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+  };
+
+  // Pulse waveforms, step 0 in the high bit
+  const uint8_t DUTY[4] = {0x01, 0x81, 0x87, 0x7E};
+  const uint8_t NOISE_DIVISOR[8] = {8, 16, 32, 48, 64, 80, 96, 112};
+  // Wave output level (NR32) as a right shift; level 0 mutes
+  const uint8_t WAVE_SHIFT[4] = {4, 0, 1, 2};
+
+  // 4 channels at level 15 and master volume 8 stay inside 16 bits
+  constexpr int32_t AMP_SCALE = 64;
+}
+
+APU::APU(uint32_t sampleRate) : blip(CLOCK_RATE, sampleRate, sampleRate / 2) {
+  // State left behind by the boot ROM: powered, channel 1 enabled but silent
+  power = true;
+  registers[0x01] = 0x80;
+  registers[0x02] = 0xF3;
+  registers[0x14] = 0x77;
+  registers[0x15] = 0xF3;
+  channels[0].enabled = true;
+  updateGains(0);
+}
+
+uint8_t APU::read(uint16_t addr, uint64_t clock) {
+  catchUp(clock);
+  uint8_t index = addr - 0xFF10;
+  if (addr >= 0xFF30) { // wave RAM
+    return registers[index];
+  }
+  if (addr == 0xFF26) { // NR52, channel status is read only
+    uint8_t status = (power ? 0x80u : 0) | READ_MASK[index];
+    for (int ch = 0; ch < 4; ch++) {
+      if (channels[ch].enabled) status |= 1u << ch;
+    }
+    return status;
+  }
+  return registers[index] | READ_MASK[index];
+}
+
+void APU::write(uint16_t addr, uint8_t value, uint64_t clock) {
+  catchUp(clock);
+  uint8_t index = addr - 0xFF10;
+  if (addr >= 0xFF30) { // wave RAM
+    registers[index] = value;
+    return;
+  }
+  if (addr == 0xFF26) { // NR52
+    bool on = (value & 0x80u) != 0;
+    if (power && !on) {
+      // Powering off clears every register and silences all channels
+      std::fill(registers.begin(), registers.begin() + 0x16, 0);
+      for (int ch = 0; ch < 4; ch++) {
+        channels[ch].enabled = false;
+        setOutput(ch, 0, clock);
+      }
+      updateGains(clock);
+    }
+    power = on;
+    return;
+  }
+  if (!power || addr > 0xFF26) {
+    return;
+  }
+  registers[index] = value;
+  if (addr == 0xFF24 || addr == 0xFF25) { // NR50/NR51
+    updateGains(clock);
+    return;
+  }
+
+  int ch = index / 5;
+  APU_CHANNEL &c = channels[ch];
+  switch (index % 5) {
+    case 1: // length
+      c.length = ch == 2 ? 256 - value : 64 - (value & 0x3Fu);
+      break;
+    case 0:
+    case 2: // NR30 and NRx2 hold the DAC enable
+      if (!dacOn(ch)) {
+        c.enabled = false;
+      }
+      break;
+    case 4:
+      c.lengthEnable = (value & 0x40u) != 0;
+      if (value & 0x80u) {
+        trigger(ch, clock);
+      }
+      break;
+    default:
+      break;
+  }
+  setOutput(ch, level(ch), clock);
+}
+
+void APU::catchUp(uint64_t clock) {
+  if (!synthesize && sequencerIdle()) {
+    lastClock = std::max(lastClock, clock);
+    return;
+  }
+  while (lastClock < clock) {
+    uint64_t tick = (lastClock / CLOCK_FRAME_SEQUENCER + 1) * CLOCK_FRAME_SEQUENCER;
+    uint64_t end = std::min(tick, clock);
+    if (power && synthesize) {
+      runChannels(end);
+    }
+    lastClock = end;
+    if (power && end == tick) {
+      sequencerStep(tick);
+    }
+  }
+}
+
+void APU::setSynthesis(bool enabled, uint64_t clock) {
+  catchUp(clock);
+  if (enabled == synthesize) {
+    return;
+  }
+  if (enabled) {
+    // Frequency timers were not kept up while off, and the silence since is
+    // not worth delivering
+    synthesize = true;
+    blip.reset(lastClock);
+    for (int ch = 0; ch < 4; ch++) {
+      channels[ch].nextTick = lastClock + period(ch);
+      setOutput(ch, level(ch), lastClock);
+    }
+  } else {
+    for (int ch = 0; ch < 4; ch++) {
+      setOutput(ch, 0, lastClock);
+    }
+    synthesize = false;
+  }
+}
+
+// Nothing the frame sequencer does can be observed: every channel is off and
+// no length counter is running
+bool APU::sequencerIdle() const {
+  if (!power) {
+    return true;
+  }
+  for (const APU_CHANNEL &c : channels) {
+    if (c.enabled || (c.lengthEnable && c.length > 0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t APU::samplesAvailable(uint64_t clock) {
+  catchUp(clock);
+  return blip.available(lastClock);
+}
+
+size_t APU::readSamples(int16_t *out, size_t frames, uint64_t clock) {
+  catchUp(clock);
+  return blip.read(out, frames, lastClock);
+}
+
+bool APU::dacOn(int channel) {
+  if (channel == 2) {
+    return (reg(2, 0) & 0x80u) != 0;
+  }
+  return (reg(channel, 2) & 0xF8u) != 0;
+}
+
+uint64_t APU::period(int channel) {
+  switch (channel) {
+    case 0:
+    case 1:
+      return (2048 - frequency(channel)) * 4;
+    case 2:
+      return (2048 - frequency(channel)) * 2;
+    default: {
+      uint8_t nr43 = reg(3, 3);
+      return static_cast<uint64_t>(NOISE_DIVISOR[nr43 & 0x7u]) << (nr43 >> 4u);
+    }
+  }
+}
+
+uint8_t APU::level(int channel) {
+  const APU_CHANNEL &c = channels[channel];
+  if (!c.enabled) {
+    return 0;
+  }
+  switch (channel) {
+    case 0:
+    case 1:
+      return ((DUTY[reg(channel, 1) >> 6u] >> (7 - c.position)) & 1u) ? c.volume : 0;
+    case 2: {
+      uint8_t sample = registers[0x20 + c.position / 2];
+      sample = (c.position & 1u) ? sample & 0xFu : sample >> 4u;
+      return sample >> WAVE_SHIFT[(reg(2, 2) >> 5u) & 0x3u];
+    }
+    default:
+      return (lfsr & 1u) ? 0 : c.volume;
+  }
+}
+
+void APU::setOutput(int channel, uint8_t value, uint64_t clock) {
+  APU_CHANNEL &c = channels[channel];
+  if (synthesize && value != c.output) {
+    int32_t delta = value - c.output;
+    c.output = value;
+    blip.addDelta(clock, delta * gainLeft[channel], delta * gainRight[channel]);
+  }
+}
+
+void APU::updateGains(uint64_t clock) {
+  uint8_t nr50 = registers[0x14];
+  uint8_t nr51 = registers[0x15];
+  int32_t left = 0;
+  int32_t right = 0;
+  for (int ch = 0; ch < 4; ch++) {
+    int32_t l = (nr51 >> (ch + 4u) & 1u) * (((nr50 >> 4u) & 0x7u) + 1) * AMP_SCALE;
+    int32_t r = (nr51 >> ch & 1u) * ((nr50 & 0x7u) + 1) * AMP_SCALE;
+    left += channels[ch].output * (l - gainLeft[ch]);
+    right += channels[ch].output * (r - gainRight[ch]);
+    gainLeft[ch] = l;
+    gainRight[ch] = r;
+  }
+  if (left != 0 || right != 0) {
+    blip.addDelta(clock, left, right);
+  }
+}
+
+void APU::runChannels(uint64_t end) {
+  for (int ch = 0; ch < 4; ch++) {
+    APU_CHANNEL &c = channels[ch];
+    if (!c.enabled) {
+      continue;
+    }
+    // Noise with a clock shift of 14 or 15 never clocks the LFSR
+    if (ch == 3 && (reg(3, 3) >> 4u) >= 14) {
+      c.nextTick = end;
+      continue;
+    }
+    uint64_t step = period(ch);
+    while (c.nextTick < end) {
+      if (ch == 3) {
+        uint16_t bit = (lfsr ^ (lfsr >> 1u)) & 1u;
+        lfsr = (lfsr >> 1u) | (bit << 14u);
+        if (reg(3, 3) & 0x8u) { // 7 bit mode
+          lfsr = (lfsr & ~0x40u) | (bit << 6u);
+        }
+      } else {
+        c.position = (c.position + 1) & (ch == 2 ? 31 : 7);
+      }
+      setOutput(ch, level(ch), c.nextTick);
+      c.nextTick += step;
+    }
+  }
+}
+
+void APU::sequencerStep(uint64_t clock) {
+  uint64_t step = (clock / CLOCK_FRAME_SEQUENCER) & 0x7u;
+
+  if ((step & 1u) == 0) { // length on 0, 2, 4, 6
+    for (APU_CHANNEL &c : channels) {
+      if (c.lengthEnable && c.length > 0 && --c.length == 0) {
+        c.enabled = false;
+      }
+    }
+  }
+
+  if (step == 2 || step == 6) { // sweep
+    uint8_t pace = (reg(0, 0) >> 4u) & 0x7u;
+    if (sweepTimer > 0 && --sweepTimer == 0) {
+      sweepTimer = pace != 0 ? pace : 8;
+      if (sweepEnabled && pace != 0) {
+        uint16_t next = sweepFrequency();
+        if (next <= 2047 && (reg(0, 0) & 0x7u) != 0) {
+          sweepShadow = next;
+          reg(0, 3) = next & 0xFFu;
+          reg(0, 4) = (reg(0, 4) & 0xF8u) | next >> 8u;
+          sweepFrequency();
+        }
+      }
+    }
+  }
+
+  if (step == 7) { // envelope
+    for (int ch : {0, 1, 3}) {
+      APU_CHANNEL &c = channels[ch];
+      uint8_t envelope = reg(ch, 2);
+      uint8_t pace = envelope & 0x7u;
+      if (pace == 0 || (c.envelopeTimer > 0 && --c.envelopeTimer > 0)) {
+        continue;
+      }
+      c.envelopeTimer = pace;
+      if ((envelope & 0x8u) && c.volume < 15) {
+        c.volume++;
+      } else if (!(envelope & 0x8u) && c.volume > 0) {
+        c.volume--;
+      }
+    }
+  }
+
+  for (int ch = 0; ch < 4; ch++) {
+    setOutput(ch, level(ch), clock);
+  }
+}
+
+void APU::trigger(int channel, uint64_t clock) {
+  APU_CHANNEL &c = channels[channel];
+  c.enabled = dacOn(channel);
+  if (c.length == 0) {
+    c.length = channel == 2 ? 256 : 64;
+  }
+  c.nextTick = clock + period(channel);
+  if (channel == 2) {
+    c.position = 0;
+  } else {
+    c.volume = reg(channel, 2) >> 4u;
+    c.envelopeTimer = reg(channel, 2) & 0x7u;
+  }
+  if (channel == 3) {
+    lfsr = 0x7FFF;
+  }
+  if (channel == 0) {
+    uint8_t pace = (reg(0, 0) >> 4u) & 0x7u;
+    uint8_t shift = reg(0, 0) & 0x7u;
+    sweepShadow = frequency(0);
+    sweepTimer = pace != 0 ? pace : 8;
+    sweepEnabled = pace != 0 || shift != 0;
+    if (shift != 0) {
+      sweepFrequency();
+    }
+  }
+}
+
+// Next sweep frequency; disables channel 1 when it overflows
+uint16_t APU::sweepFrequency() {
+  uint16_t delta = sweepShadow >> (reg(0, 0) & 0x7u);
+  uint16_t next = (reg(0, 0) & 0x8u) ? sweepShadow - delta : sweepShadow + delta;
+  if (next > 2047) {
+    channels[0].enabled = false;
+  }
+  return next;
+}
@@ -0,0 +1,162 @@
+#include "../../include/pgb/AudioSink.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace {
+  const double PI = 3.14159265358979323846;
+
+  // One output frame: both history channels against one kernel phase
+  inline void convolve(const float *taps, const float *left, const float *right, float &outLeft, float &outRight) {
+#if defined(__SSE2__)
+    __m128 l = _mm_setzero_ps();
+    __m128 r = _mm_setzero_ps();
+    for (int k = 0; k < 16; k += 4) {
+      __m128 c = _mm_loadu_ps(taps + k);
+      l = _mm_add_ps(l, _mm_mul_ps(c, _mm_loadu_ps(left + k)));
+      r = _mm_add_ps(r, _mm_mul_ps(c, _mm_loadu_ps(right + k)));
+    }
+    // Horizontal sums, left in the low half and right in the high half
+    __m128 lr = _mm_add_ps(_mm_unpacklo_ps(l, r), _mm_unpackhi_ps(l, r));
+    lr = _mm_add_ps(lr, _mm_movehl_ps(lr, lr));
+    outLeft = _mm_cvtss_f32(lr);
+    outRight = _mm_cvtss_f32(_mm_shuffle_ps(lr, lr, 1));
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    float32x4_t l = vdupq_n_f32(0);
+    float32x4_t r = vdupq_n_f32(0);
+    for (int k = 0; k < 16; k += 4) {
+      float32x4_t c = vld1q_f32(taps + k);
+      l = vfmaq_f32(l, c, vld1q_f32(left + k));
+      r = vfmaq_f32(r, c, vld1q_f32(right + k));
+    }
+    outLeft = vaddvq_f32(l);
+    outRight = vaddvq_f32(r);
+#else
+    float l = 0;
+    float r = 0;
+    for (int k = 0; k < 16; k++) {
+      l += taps[k] * left[k];
+      r += taps[k] * right[k];
+    }
+    outLeft = l;
+    outRight = r;
+#endif
+  }
+
+  inline int16_t toSample(float value) {
+    return static_cast<int16_t>(std::lround(std::max(-32768.0f, std::min(32767.0f, value))));
+  }
+}
+
+constexpr size_t AudioSink::CHUNK;
+
+AudioSink::AudioSink(uint32_t inputRate, uint32_t outputRate, size_t targetFrames)
+  : ring(targetFrames * 2 * 4), rate(inputRate), target(targetFrames), baseStep(static_cast<double>(inputRate) / outputRate),
+    kernel(PHASES), historyLeft(TAPS + CHUNK * 2), historyRight(TAPS + CHUNK * 2) {
+  static_assert(TAPS == 16, "convolve() is unrolled for 16 taps");
+  // Blackman windowed sinc; cut off below the lower of the two Nyquist
+  // frequencies so downsampling doesn't alias
+  double cutoff = 0.9 * std::min(1.0, 1.0 / baseStep);
+  for (int phase = 0; phase < PHASES; phase++) {
+    double taps[TAPS];
+    double sum = 0;
+    for (int k = 0; k < TAPS; k++) {
+      double x = k - (TAPS / 2 - 1) - static_cast<double>(phase) / PHASES;
+      double sinc = x == 0 ? 1.0 : std::sin(PI * cutoff * x) / (PI * cutoff * x);
+      double w = (x + TAPS / 2) / TAPS;
+      double window = 0.42 - 0.5 * std::cos(2 * PI * w) + 0.08 * std::cos(4 * PI * w);
+      taps[k] = sinc * window;
+      sum += taps[k];
+    }
+    for (int k = 0; k < TAPS; k++) {
+      kernel[phase][k] = static_cast<float>(taps[k] / sum);
+    }
+  }
+}
+
+size_t AudioSink::push(const int16_t *samples, size_t frames) {
+  size_t written = ring.write(samples, frames * 2) / 2;
+  if (written < frames) {
+    overrunCount.fetch_add(1, std::memory_order_relaxed);
+  }
+  return written;
+}
+
+void AudioSink::pull(int16_t *out, size_t frames) {
+  size_t queued = queuedFrames();
+  if (starved) {
+    // Wait for the queue to build back up instead of stuttering on every block
+    if (queued < target) {
+      memset(out, 0, frames * 2 * sizeof(int16_t));
+      return;
+    }
+    starved = false;
+  }
+
+  double error = (static_cast<double>(queued) - target) / target;
+  double step = baseStep * (1.0 + MAX_RATE_ADJUST * std::max(-1.0, std::min(1.0, error)));
+
+  for (size_t i = 0; i < frames; i++) {
+    size_t index = static_cast<size_t>(position);
+    while (index + TAPS > filled) {
+      if (!refill()) {
+        memset(out + i * 2, 0, (frames - i) * 2 * sizeof(int16_t));
+        underrunCount.fetch_add(1, std::memory_order_relaxed);
+        starved = true;
+        return;
+      }
+      index = static_cast<size_t>(position);
+    }
+    int phase = static_cast<int>((position - index) * PHASES);
+    float left;
+    float right;
+    convolve(kernel[phase].data(), &historyLeft[index], &historyRight[index], left, right);
+    out[i * 2] = toSample(left);
+    out[i * 2 + 1] = toSample(right);
+    position += step;
+  }
+}
+
+// Moves the next chunk of queued input into the history, dropping frames the
+// filter has moved past. False when the queue is empty.
+bool AudioSink::refill() {
+  size_t consumed = std::min(static_cast<size_t>(position), filled);
+  if (consumed > 0) {
+    std::copy(historyLeft.begin() + consumed, historyLeft.begin() + filled, historyLeft.begin());
+    std::copy(historyRight.begin() + consumed, historyRight.begin() + filled, historyRight.begin());
+    filled -= consumed;
+    position -= consumed;
+  }
+
+  size_t room = std::min(CHUNK, historyLeft.size() - filled);
+  size_t frames = ring.read(chunk.data(), room * 2) / 2;
+  for (size_t i = 0; i < frames; i++) {
+    historyLeft[filled + i] = chunk[i * 2];
+    historyRight[filled + i] = chunk[i * 2 + 1];
+  }
+  filled += frames;
+  return frames > 0;
+}
+
+ToneSource::ToneSource(uint32_t sampleRate, double frequency, int16_t amplitude)
+  : step(2 * PI * frequency / sampleRate), amplitude(amplitude) {
+}
+
+void ToneSource::generate(int16_t *out, size_t frames) {
+  for (size_t i = 0; i < frames; i++) {
+    int16_t sample = static_cast<int16_t>(std::lround(std::sin(phase) * amplitude));
+    out[i * 2] = sample;
+    out[i * 2 + 1] = sample;
+    phase += step;
+    if (phase >= 2 * PI) {
+      phase -= 2 * PI;
+    }
+  }
+}
@@ -0,0 +1,99 @@
+#include "../../include/pgb/BlipBuffer.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+BlipBuffer::BlipBuffer(uint64_t clockRate, uint32_t sampleRate, size_t capacity) : rate(sampleRate) {
+  factor = ((static_cast<uint64_t>(sampleRate) << FRACTION_BITS) + clockRate / 2) / clockRate;
+
+  size_t size = 1;
+  while (size < capacity + TAPS) size <<= 1u;
+  left.resize(size);
+  right.resize(size);
+  mask = size - 1;
+
+  // Blackman windowed sinc, cut off a little below Nyquist. Each phase is
+  // normalized so its taps sum to exactly 1 << DELTA_BITS, so integrated steps
+  // land on the right amplitude with no drift.
+  const double pi = 3.14159265358979323846;
+  const double cutoff = 0.9;
+  for (int phase = 0; phase < PHASES; phase++) {
+    double taps[TAPS];
+    double sum = 0;
+    for (int k = 0; k < TAPS; k++) {
+      double x = k - (HALF_WIDTH - 1) - static_cast<double>(phase) / PHASES;
+      double sinc = x == 0 ? 1.0 : std::sin(pi * cutoff * x) / (pi * cutoff * x);
+      double w = (x + HALF_WIDTH) / TAPS;
+      double window = 0.42 - 0.5 * std::cos(2 * pi * w) + 0.08 * std::cos(4 * pi * w);
+      taps[k] = sinc * window;
+      sum += taps[k];
+    }
+    int32_t total = 0;
+    int largest = 0;
+    for (int k = 0; k < TAPS; k++) {
+      kernel[phase][k] = static_cast<int32_t>(std::lround(taps[k] / sum * (1 << DELTA_BITS)));
+      total += kernel[phase][k];
+      if (kernel[phase][k] > kernel[phase][largest]) largest = k;
+    }
+    kernel[phase][largest] += (1 << DELTA_BITS) - total;
+  }
+}
+
+void BlipBuffer::addDelta(uint64_t clock, int32_t leftDelta, int32_t rightDelta) {
+  uint64_t pos = position(clock);
+  uint64_t index = (pos >> FRACTION_BITS) - (HALF_WIDTH - 1);
+  const std::array<int32_t, TAPS> &taps = kernel[(pos >> (FRACTION_BITS - PHASE_BITS)) & (PHASES - 1)];
+
+  // Nobody is reading: make room by dropping the oldest samples
+  if (index + TAPS - readIndex > left.size()) {
+    discard(index + TAPS - readIndex - left.size());
+  }
+  for (int k = 0; k < TAPS; k++) {
+    left[(index + k) & mask] += taps[k] * leftDelta;
+    right[(index + k) & mask] += taps[k] * rightDelta;
+  }
+}
+
+size_t BlipBuffer::available(uint64_t clock) const {
+  // Steps at or after `clock` can still touch the HALF_WIDTH - 1 samples before it
+  uint64_t complete = (position(clock) >> FRACTION_BITS) - (HALF_WIDTH - 1);
+  return complete > readIndex ? complete - readIndex : 0;
+}
+
+size_t BlipBuffer::read(int16_t *out, size_t frames, uint64_t clock) {
+  frames = std::min(frames, available(clock));
+  integrate<true>(out, frames);
+  return frames;
+}
+
+void BlipBuffer::discard(size_t frames) {
+  integrate<false>(nullptr, frames);
+}
+
+void BlipBuffer::reset(uint64_t clock) {
+  std::fill(left.begin(), left.end(), 0);
+  std::fill(right.begin(), right.end(), 0);
+  leftSum = 0;
+  rightSum = 0;
+  readIndex += available(clock);
+}
+
+template<bool output>
+void BlipBuffer::integrate(int16_t *out, size_t frames) {
+  for (size_t i = 0; i < frames; i++) {
+    size_t index = (readIndex + i) & mask;
+    leftSum += left[index];
+    rightSum += right[index];
+    left[index] = 0;
+    right[index] = 0;
+    int32_t l = leftSum >> DELTA_BITS;
+    int32_t r = rightSum >> DELTA_BITS;
+    leftSum -= l << (DELTA_BITS - BASS_SHIFT);
+    rightSum -= r << (DELTA_BITS - BASS_SHIFT);
+    if (output) {
+      out[i * 2] = static_cast<int16_t>(std::max(-32768, std::min(32767, l)));
+      out[i * 2 + 1] = static_cast<int16_t>(std::max(-32768, std::min(32767, r)));
+    }
+  }
+  readIndex += frames;
+}
@@ -122,6 +122,20 @@ CPU::CPU(std::shared_ptr<MMU> mmu) : mmu(std::move(mmu)) {
 }
 
 void CPU::emulateInstruction() {
+  mmu->update();
+  uint8_t pending = mmu->pendingInterrupts();
+  if (pending != 0) {
+    _halted = false;
+    if (mmu->interrupts_enabled) {
+      serviceInterrupt(pending);
+      return;
+    }
+  }
+  if (_halted) {
+    clock(4);
+    return;
+  }
+
   uint8_t op = pcRead8();
 
   instrUsages[op]++;
@@ -131,8 +145,31 @@ void CPU::emulateInstruction() {
 //  printState();
 }
 
+void CPU::serviceInterrupt(uint8_t pending) {
+  // Lowest bit wins: VBlank, STAT, timer, serial, joypad
+  uint8_t bit = 0;
+  while ((pending & (1u << bit)) == 0) bit++;
+  mmu->interrupt_flag &= ~(1u << bit);
+  disableInterrupts();
+
+  clock(12);
+  sp(sp() - 2);
+  write16(sp(), pc());
+  pc(0x40 + bit * 8);
+}
+
+void CPU::halt() {
+  _halted = true;
+}
+
+void CPU::haltUntil(uint64_t clock) {
+  if (_halted && mmu->pendingInterrupts() == 0 && clock > mmu->clock) {
+    mmu->clock = clock;
+  }
+}
+
 void CPU::printState() {
-  printf("====%.8llu====\n", _clock);
+  printf("====%.8llu====\n", mmu->clock);
   printf("AF %0.4x ", af());
   printf(" BC: %0.4x ", bc());
   if (zero()) printf("Z");
@@ -873,9 +873,9 @@ void op_75(CPU *cpu) {
   cpu->write8(cpu->h(), cpu->l());
 }
 
-void op_76(CPU __unused *cpu) {
+void op_76(CPU *cpu) {
   // halt
-  // TODO halt
+  cpu->halt();
 }
 
 void op_77(CPU *cpu) {
@@ -0,0 +1,59 @@
+#include "../../include/pgb/GameBoy.hpp"
+
+#include <algorithm>
+#include <utility>
+
+GameBoy::GameBoy(std::shared_ptr<ROM> rom, GPU_OUTPUT_FORMAT format, bool threadedGpu)
+  : rom(std::move(rom)) {
+  mmu = std::make_shared<MMU>(this->rom);
+  cpu = std::make_shared<CPU>(mmu);
+  gpu = std::make_shared<GPU>(mmu, format, threadedGpu);
+}
+
+void GameBoy::runUntil(uint64_t target) {
+  stopRequested = false;
+  while (mmu->clock < target && !stopRequested) {
+    step(target);
+  }
+  // Run what the next instruction would run first, so events due by now
+  // (like a serial exchange) have happened when this returns
+  mmu->update();
+}
+
+// One instruction, or a halt skipped ahead to the next event but no further than `limit`
+void GameBoy::step(uint64_t limit) {
+  cpu->emulateInstruction();
+  if (cpu->halted()) {
+    cpu->haltUntil(std::min({gpu->nextEvent(), mmu->nextEvent(), limit}));
+  }
+  gpu->advanceTo(mmu->clock);
+}
+
+void GameBoy::runFrame() {
+  mmu->joypad.clearPolled();
+  uint64_t vblanks = gpu->vblankCount();
+  // The LCD being off means no VBlank to wait for; a frame's worth of cycles stands in
+  uint64_t limit = mmu->clock + CLOCK_FRAME;
+  while (gpu->vblankCount() == vblanks) {
+    bool lcdOff = !mmu->lcdPower();
+    if (lcdOff && mmu->clock >= limit) {
+      break;
+    }
+    step(lcdOff ? limit : UINT64_MAX);
+  }
+  mmu->update();
+  lastFrameLagged = !mmu->joypad.polled();
+  if (lastFrameLagged) {
+    lagFrameCount++;
+  }
+}
+
+uint64_t GameBoy::runUntilInputPolled(uint64_t maxFrames) {
+  for (uint64_t frames = 1; frames <= maxFrames; frames++) {
+    runFrame();
+    if (!lastFrameLagged) {
+      return frames;
+    }
+  }
+  return maxFrames;
+}
@@ -1,124 +1,826 @@
 #include "../../include/pgb/GPU.hpp"
 
+#include <algorithm>
 #include <utility>
 
-GPU::GPU(std::shared_ptr<MMU> mmu) : mmu(std::move(mmu)) {}
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-void GPU::update(uint64_t clockDelta) {
-  if (!mmu->lcdPower()) {
-    gpuClock = 0;
-    return;
+static constexpr uint64_t XXH_PRIME1 = 0x9E3779B185EBCA87ull;
+static constexpr uint64_t XXH_PRIME2 = 0xC2B2AE3D27D4EB4Full;
+static constexpr uint64_t XXH_PRIME3 = 0x165667B19E3779F9ull;
+static constexpr uint64_t XXH_PRIME4 = 0x85EBCA77C2B2AE63ull;
+static constexpr uint64_t XXH_PRIME5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+  return rotl64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t value) {
+  return (acc ^ xxhRound(0, value)) * XXH_PRIME1 + XXH_PRIME4;
+}
+
+// XXH64 with seed 0, for inputs that are a whole number of 32 byte stripes
+// (a 160 byte line, or the 144 line hashes of a frame)
+static uint64_t xxh64(const uint8_t *data, size_t length) {
+  uint64_t v1 = XXH_PRIME1 + XXH_PRIME2;
+  uint64_t v2 = XXH_PRIME2;
+  uint64_t v3 = 0;
+  uint64_t v4 = 0 - XXH_PRIME1;
+  for (size_t i = 0; i < length; i += 32) {
+    uint64_t lanes[4];
+    memcpy(lanes, data + i, sizeof(lanes));
+    v1 = xxhRound(v1, lanes[0]);
+    v2 = xxhRound(v2, lanes[1]);
+    v3 = xxhRound(v3, lanes[2]);
+    v4 = xxhRound(v4, lanes[3]);
+  }
+  uint64_t h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+  h = xxhMerge(h, v1);
+  h = xxhMerge(h, v2);
+  h = xxhMerge(h, v3);
+  h = xxhMerge(h, v4);
+  h += length;
+  h ^= h >> 33;
+  h *= XXH_PRIME2;
+  h ^= h >> 29;
+  h *= XXH_PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
+constexpr uint16_t GPU::NO_CELL;
+
+GPU::GPU(std::shared_ptr<MMU> mmu, GPU_OUTPUT_FORMAT format, bool threaded) :
+  mmu(std::move(mmu)), format(format), cgbMode(this->mmu->gbcMode), mem(&this->mmu->video), threaded(threaded) {
+  // Threaded INDEX8 frames are copied out of vsyncBuffer so the renderer can keep writing it
+  if (format != GPU_OUTPUT_FORMAT::INDEX8 || threaded) {
+    output.resize(frameSize());
+  }
+  if (cgbMode && (format == GPU_OUTPUT_FORMAT::RGB555 || format == GPU_OUTPUT_FORMAT::ARGB8888)) {
+    colorbuffer.resize(frameSize());
+    vsyncColors.resize(frameSize());
+  }
+  if (threaded) {
+    // Enough for a frame's worth of heavy VRAM traffic before the emulation thread has to wait
+    commands.reset(new SpscRing<GPU_COMMAND>(1u << 16u));
+    shadow.reset(new VideoMemory(this->mmu->video));
+    mem = shadow.get();
+    this->mmu->recordVideoWrites(this);
+    running = true;
+    renderThread = std::thread(&GPU::renderLoop, this);
+  }
+}
+
+GPU::~GPU() {
+  if (threaded) {
+    mmu->recordVideoWrites(nullptr);
+    running = false;
+    {
+      std::lock_guard<std::mutex> lock(wakeMutex);
+      wake.notify_one();
+    }
+    renderThread.join();
+  }
+}
+
+// Queues a command for the render thread, waiting for room if the queue is full
+void GPU::submit(const GPU_COMMAND &command, bool notify) {
+  while (!commands->push(command)) {
+    wakeRenderer();
+    std::this_thread::yield();
+  }
+  if (notify) {
+    wakeRenderer();
+  }
+}
+
+void GPU::wakeRenderer() {
+  // Pairs with the fence in renderLoop(): either it sees the new command or we see it idle
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (renderIdle.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(wakeMutex);
+    wake.notify_one();
   }
+}
 
-  // TODO: there might be a cleaner solution
-  gpuClock += clockDelta;
-  switch (mmu->gpu_mode) {
-    case GPU_MODE::SCAN_OAM:
-      if (gpuClock > CLOCK_SCANLINE_OAM) {
-        gpuClock -= CLOCK_SCANLINE_OAM;
-        mmu->gpu_mode = GPU_MODE::SCAN_VRAM;
+void GPU::renderLoop() {
+  std::array<GPU_COMMAND, 256> batch;
+  while (true) {
+    size_t count = commands->read(batch.data(), batch.size());
+    if (count == 0) {
+      if (!running) return;
+      renderIdle.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      {
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        wake.wait(lock, [this] { return !commands->empty() || !running; });
       }
+      renderIdle.store(false, std::memory_order_relaxed);
+      continue;
+    }
+    for (size_t i = 0; i < count; i++) {
+      execute(batch[i]);
+    }
+  }
+}
+
+void GPU::execute(const GPU_COMMAND &command) {
+  switch (command.type) {
+    case GPU_COMMAND_TYPE::VRAM0:
+      shadow->writeVram(0, command.offset, command.value);
       break;
-    case GPU_MODE::SCAN_VRAM:
-      if (gpuClock > CLOCK_SCANLINE_VRAM) {
-        gpuClock -= CLOCK_SCANLINE_VRAM;
-        mmu->gpu_mode = GPU_MODE::HBLANK;
-        renderLine();
+    case GPU_COMMAND_TYPE::VRAM1:
+      shadow->writeVram(1, command.offset, command.value);
+      break;
+    case GPU_COMMAND_TYPE::OAM:
+      shadow->writeOam(command.offset, command.value);
+      break;
+    case GPU_COMMAND_TYPE::BG_PALETTE:
+      shadow->writePalette(shadow->bgPaletteRam, command.offset, command.value);
+      break;
+    case GPU_COMMAND_TYPE::OBJ_PALETTE:
+      shadow->writePalette(shadow->objPaletteRam, command.offset, command.value);
+      break;
+    case GPU_COMMAND_TYPE::LINE:
+      renderLine(command.registers);
+      break;
+    case GPU_COMMAND_TYPE::FRAME:
+      writeToVsyncBuffer();
+      {
+        std::lock_guard<std::mutex> lock(frameMutex);
       }
+      frameDone.notify_all();
       break;
-    case GPU_MODE::HBLANK:
-      if (gpuClock > CLOCK_SCANLINE_HBLANK) {
-        gpuClock -= CLOCK_SCANLINE_HBLANK;
+  }
+}
+
+void GPU::finishFrame() {
+  if (!threaded) {
+    writeToVsyncBuffer();
+    return;
+  }
+  GPU_COMMAND command{};
+  command.type = GPU_COMMAND_TYPE::FRAME;
+  submit(command, true);
+  framesSubmitted++;
+  // Let the renderer fall at most one frame behind
+  std::unique_lock<std::mutex> lock(frameMutex);
+  frameDone.wait(lock, [this] { return completedFrames.load() + 1 >= framesSubmitted; });
+}
+
+void GPU::step() {
+  if (!mmu->lcdPower()) {
+    // LY reads 0 and STAT reports mode 0 while the LCD is off
+    lcdOn = false;
+    mmu->gpu_line = 0;
+    mmu->setGpuMode(GPU_MODE::SCAN_OAM);
+    mmu->updateStat();
+    nextEventClock = UINT64_MAX;
+    return;
+  }
+  if (!lcdOn) {
+    // Turning the LCD on starts a new frame at line 0
+    lcdOn = true;
+    mmu->gpu_line = 0;
+    mmu->setGpuMode(GPU_MODE::SCAN_OAM);
+    mmu->updateStat();
+    nextEventClock = gpuClock + CLOCK_SCANLINE_OAM;
+  }
+
+  while (gpuClock >= nextEventClock) {
+    switch (mmu->gpu_mode) {
+      case GPU_MODE::SCAN_OAM:
+        mmu->setGpuMode(GPU_MODE::SCAN_VRAM);
+        nextEventClock += CLOCK_SCANLINE_VRAM;
+        break;
+      case GPU_MODE::SCAN_VRAM:
+        mmu->setGpuMode(GPU_MODE::HBLANK);
+        nextEventClock += CLOCK_SCANLINE_HBLANK;
+        if (threaded) {
+          GPU_COMMAND command{};
+          command.type = GPU_COMMAND_TYPE::LINE;
+          command.registers = mmu->lineRegisters();
+          submit(command, true);
+        } else {
+          renderLine(mmu->lineRegisters());
+        }
+        mmu->enterHblank();
+        break;
+      case GPU_MODE::HBLANK:
         mmu->gpu_line++;
         if (mmu->gpu_line == LINES) {
-          writeToVsyncBuffer();
-          mmu->gpu_mode = GPU_MODE::VBLANK;
+          vblanks++;
+          finishFrame();
+          // Keep the sound output flowing even if the game never touches it
+          mmu->apu->catchUp(nextEventClock);
+          mmu->setGpuMode(GPU_MODE::VBLANK);
+          mmu->requestInterrupt(INTERRUPT_VBLANK);
+          nextEventClock += CLOCK_SCANLINE;
         } else {
-          mmu->gpu_mode = GPU_MODE::SCAN_OAM;
+          mmu->setGpuMode(GPU_MODE::SCAN_OAM);
+          nextEventClock += CLOCK_SCANLINE_OAM;
         }
-      }
-      break;
-    case GPU_MODE::VBLANK:
-      if (gpuClock > CLOCK_SCANLINE) {
-        gpuClock -= CLOCK_SCANLINE;
+        break;
+      case GPU_MODE::VBLANK:
         mmu->gpu_line++;
-        if (mmu->gpu_line > LINES + 10) {
-          mmu->gpu_mode = GPU_MODE::SCAN_OAM;
+        if (mmu->gpu_line == LINES + 10) {
+          mmu->setGpuMode(GPU_MODE::SCAN_OAM);
           mmu->gpu_line = 0;
+          nextEventClock += CLOCK_SCANLINE_OAM;
+        } else {
+          nextEventClock += CLOCK_SCANLINE;
         }
-      }
-      break;
+        break;
+    }
+    mmu->updateStat();
   }
 }
 
+void GPU::renderLine(const GPU_LINE_REGISTERS &registers) {
+  regs = registers;
+  if (cgbMode) {
+    renderLine<true>();
+  } else {
+    renderLine<false>();
+  }
+}
+
+template<bool cgb>
 void GPU::renderLine() {
-  uint8_t tileset = mmu->lcdBGWindowTileset();
-  uint16_t tilesetOffset = tileset == 0 ? 0x800 : 0x0;
+  uint8_t *out = &framebuffer[regs.line * LINE_WIDTH];
+  // Background layer pixels: color number, and for CGB the palette (bits 2-4) and priority (bit 7)
+  std::array<uint8_t, LINE_WIDTH> bg{};
 
-  // add the offset to the beginning of the line where we care
+  if (regs.line == 0) {
+    windowLine = 0;
+  }
 
-  uint16_t line = mmu->gpu_line + mmu->scrollY;
-  uint16_t col = mmu->scrollX;
+  // On CGB, LCDC bit 0 is the BG priority master switch rather than a BG enable
+  bool drawBg = cgb || regs.bgEnabled();
+  // The window replaces the background from WX-7 onwards, so every column
+  // comes from exactly one of the two maps
+  int windowStart = LINE_WIDTH;
+  if (regs.lcdWindowEnable() && regs.line >= regs.windowY && regs.windowX < LINE_WIDTH + 7) {
+    windowStart = regs.windowX < 7 ? 0 : regs.windowX - 7;
+  }
 
-  uint8_t tile_y = line / 8;
-  uint8_t tile_x = col / 8;
-  uint8_t tile_relative_y = line % 8;
-  uint8_t tile_relative_x = col % 8;
+  uint32_t roi = regionOfInterest.load(std::memory_order_relaxed);
+  uint8_t top = roi & 0xFFu;
+  uint8_t bottom = (roi >> 8u) & 0xFFu;
+  int left = (roi >> 16u) & 0xFFu;
+  int right = (roi >> 24u) & 0xFFu;
+  if (regs.line < top || regs.line >= bottom) {
+    // Skipped lines still count towards the window's line counter
+    if (drawBg && windowStart < static_cast<int>(LINE_WIDTH)) {
+      windowLine++;
+    }
+    return;
+  }
 
-  uint16_t tile_y_offset = tile_y * (32);
+  if (cgb) {
+    if (mem->paletteDirty) {
+      updateColors();
+    }
+  } else if (regs.dmgPalettes() != shadeKey) {
+    updateShades();
+  }
 
-  uint16_t lineStartOffset = mmu->lcdBGTileMap() == 0 ? 0x1800 : 0x1c00;
-  lineStartOffset += tile_y_offset;
+  if (drawBg) {
+    uint8_t tileset = regs.lcdBGWindowTileset();
+    if (mem->vramDirty) {
+      updateLayers<cgb>();
+    }
 
-  uint8_t tile = mmu->vramread(lineStartOffset + tile_x);
-  if (tile != 0) {
-    printf("");
+    const uint8_t *bgLayer = layer<cgb>(regs.lcdBGTileMap(), tileset);
+    copyLayerRow(bg.data(), left, std::min(windowStart, right), bgLayer,
+                 regs.scrollX + left, regs.line + regs.scrollY);
+    if (windowStart < static_cast<int>(LINE_WIDTH)) {
+      const uint8_t *windowLayer = layer<cgb>(regs.lcdWindowTiles() ? 1 : 0, tileset);
+      int start = std::max(windowStart, left);
+      // Screen column x shows window column x - (WX - 7); with WX < 7 the
+      // window's first 7 - WX columns are off screen
+      copyLayerRow(bg.data(), start, right, windowLayer, start + 7 - regs.windowX, windowLine);
+      windowLine++;
+    }
   }
-  if (tileset == 0) {
-    if (tile < 128) {
-      tile += 128;
-    } else {
-      // TODO: this may need to invert the tile ordering
-    }
-  }
-  uint8_t a = mmu->vramread(tilesetOffset + (tile * 16) + (tile_relative_y * 2));
-  uint8_t b = mmu->vramread(tilesetOffset + (tile * 16) + (tile_relative_y * 2) + 1);
-  uint16_t tileData = interleave(
-    a,
-    b
-  );
-
-  if (tile != 128) {
-    printf("");
-  }
-
-  uint32_t line_off = mmu->gpu_line * LINE_WIDTH;
-  for (int i = 0; i < LINE_WIDTH; i++) {
-    uint8_t tileColor = (tileData >> (14 - tile_relative_x * 2)) & 0x3;
-    framebuffer[line_off + i] = palette.entries[tileColor];
-    tile_relative_x++;
-    if (tile_relative_x >= 8) {
-      tile_relative_x = 0;
-      tile_x++;
-      tile = mmu->vramread(lineStartOffset + tile_x);
-      if (tile != 0) {
-        printf("");
-      }
-      if (tileset == 0) {
-        if (tile < 128) {
-          tile += 128;
-        } else {
-          // TODO: this may need to invert the tile ordering
+
+  if (cgb) {
+    for (int i = left; i < right; i++) {
+      out[i] = bg[i] & 0x1Fu;
+    }
+  } else {
+    const std::array<uint8_t, 4> &bgShades = dmgShades[0];
+    for (int i = left; i < right; i++) {
+      out[i] = bgShades[bg[i]];
+    }
+  }
+  if (regs.lcdSpritesEnabled()) {
+    renderSprites<cgb>(bg.data(), out, left, right);
+  }
+  if (cgb && !colorbuffer.empty()) {
+    // Hashed after the palette lookup so palette RAM writes count as changes
+    writeColorLine(out, left, right);
+    lineHashes[regs.line] = xxh64(&colorbuffer[regs.line * frameStride()], frameStride());
+  } else {
+    lineHashes[regs.line] = xxh64(out, LINE_WIDTH);
+  }
+}
+
+void GPU::setRegionOfInterest(uint8_t top, uint8_t bottom, uint8_t left, uint8_t right) {
+  bottom = std::min<uint8_t>(bottom, LINES);
+  right = std::min<uint8_t>(right, LINE_WIDTH);
+  top = std::min(top, bottom);
+  left = std::min(left, right);
+  regionOfInterest.store(top | bottom << 8u | left << 16u | static_cast<uint32_t>(right) << 24u);
+}
+
+// Copies columns [start, end) of a line from a 256x256 layer, starting at
+// layer pixel (x, y) and wrapping around horizontally
+void GPU::copyLayerRow(uint8_t *dst, int start, int end, const uint8_t *layer, uint8_t x, uint8_t y) {
+  if (start >= end) return;
+  const uint8_t *row = layer + y * 256;
+  size_t count = end - start;
+  size_t first = std::min<size_t>(256 - x, count);
+  memcpy(dst + start, row + x, first);
+  memcpy(dst + start + first, row, count - first);
+}
+
+template<bool cgb>
+const uint8_t *GPU::layer(uint8_t map, uint8_t tileset) {
+  int index = map * 2 + tileset;
+  if (!layerValid[index]) {
+    tileCells[index].fill(NO_CELL);
+    for (uint16_t cell = 0; cell < 32 * 32; cell++) {
+      linkCell(index, cell, layerTile<cgb>(index, cell));
+      drawLayerCell<cgb>(index, cell);
+    }
+    layerValid[index] = true;
+  }
+  return bgLayers[index].data();
+}
+
+// Redraws the cached map cells whose map entry, attributes or tile data changed.
+// A map write moves its cell to the new tile's list; a tile write walks the list.
+template<bool cgb>
+void GPU::updateLayers() {
+  for (uint16_t i = 0; i < mem->dirtyMapCount; i++) {
+    uint16_t entry = mem->dirtyMapEntries[i];
+    uint16_t cell = entry % (32 * 32);
+    for (int index = entry / (32 * 32) * 2; index < entry / (32 * 32) * 2 + 2; index++) {
+      if (!layerValid[index]) continue;
+      unlinkCell(index, cell);
+      linkCell(index, cell, layerTile<cgb>(index, cell));
+      drawLayerCell<cgb>(index, cell);
+    }
+  }
+  for (uint16_t i = 0; i < mem->dirtyTileCount; i++) {
+    uint16_t tile = mem->dirtyTiles[i];
+    for (int index = 0; index < 4; index++) {
+      if (!layerValid[index]) continue;
+      for (uint16_t cell = tileCells[index][tile]; cell != NO_CELL; cell = nextCell[index][cell]) {
+        // Cells with a new map entry were already redrawn above
+        if (!mem->mapDirty[index / 2 * 32 * 32 + cell]) {
+          drawLayerCell<cgb>(index, cell);
         }
       }
-      tileData = interleave(
-        mmu->vramread(tilesetOffset + (tile * 16) + (tile_relative_y * 2)),
-        mmu->vramread(tilesetOffset + (tile * 16) + (tile_relative_y * 2) + 1)
-      );
     }
   }
+  mem->clearVramDirty();
+}
+
+void GPU::linkCell(int index, uint16_t cell, uint16_t tile) {
+  uint16_t head = tileCells[index][tile];
+  cellTile[index][cell] = tile;
+  prevCell[index][cell] = NO_CELL;
+  nextCell[index][cell] = head;
+  if (head != NO_CELL) {
+    prevCell[index][head] = cell;
+  }
+  tileCells[index][tile] = cell;
+}
+
+void GPU::unlinkCell(int index, uint16_t cell) {
+  uint16_t prev = prevCell[index][cell];
+  uint16_t next = nextCell[index][cell];
+  if (prev != NO_CELL) {
+    nextCell[index][prev] = next;
+  } else {
+    tileCells[index][cellTile[index][cell]] = next;
+  }
+  if (next != NO_CELL) {
+    prevCell[index][next] = prev;
+  }
+}
+
+// Tile number (0-383 bank 0, 384-767 bank 1) that a layer cell shows
+template<bool cgb>
+uint16_t GPU::layerTile(int index, uint16_t cell) {
+  uint16_t mapAddr = (index / 2 == 0 ? 0x1800 : 0x1c00) + cell;
+  uint8_t tile = mem->vram[0][mapAddr];
+  uint16_t id = (index % 2 == 0) ? 0x80u + (tile ^ 0x80u) : tile;
+  if (cgb && (mem->vram[1][mapAddr] & 0x08u)) {
+    id += 384;
+  }
+  return id;
+}
+
+// Draws a cell with the tile it is linked under
+template<bool cgb>
+void GPU::drawLayerCell(int index, uint16_t cell) {
+  uint16_t mapAddr = (index / 2 == 0 ? 0x1800 : 0x1c00) + cell;
+  uint16_t tile = cellTile[index][cell];
+  // CGB map attributes live in bank 1: palette, tile bank, x/y flip and priority
+  uint8_t attr = cgb ? mem->vram[1][mapAddr] : 0;
+  uint8_t extra = (attr & 0x7u) << 2 | (attr & 0x80u);
+
+  uint8_t *dst = bgLayers[index].data() + (cell / 32) * 8 * 256 + (cell % 32) * 8;
+  for (uint8_t y = 0; y < 8; y++, dst += 256) {
+    uint8_t row = (attr & 0x40u) ? 7 - y : y;
+    uint16_t tileData = tileRow(tile >= 384 ? 1 : 0, (tile % 384) * 16, row);
+    for (uint8_t x = 0; x < 8; x++) {
+      uint8_t bit = (attr & 0x20u) ? 7 - x : x;
+      dst[x] = ((tileData >> (14 - bit * 2)) & 0x3u) | extra;
+    }
+  }
+}
+
+void GPU::buildSpriteLists() {
+  uint8_t height = regs.lcdSpriteSize() ? 16 : 8;
+  lineSpriteCount.fill(0);
+  for (uint8_t sprite = 0; sprite < OAM_SPRITES; sprite++) {
+    int top = static_cast<int>(mem->oam[sprite * 4]) - 16;
+    int first = top < 0 ? 0 : top;
+    int last = top + height > static_cast<int>(LINES) ? static_cast<int>(LINES) : top + height;
+    for (int line = first; line < last; line++) {
+      if (lineSpriteCount[line] < SPRITES_PER_LINE) {
+        lineSprites[line][lineSpriteCount[line]++] = sprite;
+      }
+    }
+  }
+  spriteListHeight = height;
+  mem->oamDirty = false;
+}
+
+template<bool cgb>
+void GPU::renderSprites(const uint8_t *bg, uint8_t *out, int start, int end) {
+  uint8_t height = regs.lcdSpriteSize() ? 16 : 8;
+  if (mem->oamDirty || spriteListHeight != height) {
+    buildSpriteLists();
+  }
+
+  const std::array<uint8_t, 160> &oam = mem->oam;
+  uint8_t line = regs.line;
+  uint8_t count = lineSpriteCount[line];
+  if (count == 0) return;
+
+  std::array<uint8_t, SPRITES_PER_LINE> sprites = lineSprites[line];
+  if (!cgb) {
+    // DMG priority: lower x wins, then lower OAM index. The lists are already in
+    // OAM order (which is all CGB uses), so a stable insertion sort on x is enough.
+    for (int i = 1; i < count; i++) {
+      uint8_t sprite = sprites[i];
+      uint8_t x = oam[sprite * 4 + 1];
+      int j = i - 1;
+      for (; j >= 0 && oam[sprites[j] * 4 + 1] > x; j--) {
+        sprites[j + 1] = sprites[j];
+      }
+      sprites[j + 1] = sprite;
+    }
+  }
+  // On CGB, clearing LCDC bit 0 puts sprites above the background regardless of priority bits
+  bool bgPriority = !cgb || regs.bgEnabled();
+
+  std::array<bool, LINE_WIDTH> covered{};
+  for (int i = 0; i < count; i++) {
+    uint16_t base = sprites[i] * 4;
+    int top = static_cast<int>(oam[base]) - 16;
+    int left = static_cast<int>(oam[base + 1]) - 8;
+    uint8_t tile = oam[base + 2];
+    uint8_t attr = oam[base + 3];
+
+    uint8_t row = line - top;
+    if (attr & 0x40u) row = height - 1 - row; // y flip
+    if (height == 16) tile &= 0xFEu;
+    uint16_t tileData = tileRow(cgb && (attr & 0x08u) ? 1 : 0, tile * 16, row);
+    const std::array<uint8_t, 4> &shades = dmgShades[(attr & 0x10u) ? 2 : 1];
+    bool behindBg = (attr & 0x80u) != 0;
+
+    for (int px = 0; px < 8; px++) {
+      int x = left + px;
+      if (x < start || x >= end || covered[x]) continue;
+      uint8_t bit = (attr & 0x20u) ? 7 - px : px; // x flip
+      uint8_t color = (tileData >> (14 - bit * 2)) & 0x3;
+      if (color == 0) continue;
+      covered[x] = true;
+      if (bgPriority && (bg[x] & 0x3u) != 0 && (behindBg || (cgb && (bg[x] & 0x80u)))) continue;
+      // CGB slots 32-63 are the object palettes
+      out[x] = cgb ? 0x20u | (attr & 0x7u) << 2 | color : shades[color];
+    }
+  }
+}
+
+void GPU::writeColorLine(const uint8_t *slots, int start, int end) {
+  uint8_t *dst = &colorbuffer[regs.line * frameStride()];
+  if (format == GPU_OUTPUT_FORMAT::ARGB8888) {
+    auto *pixels = reinterpret_cast<uint32_t *>(dst);
+    for (int i = start; i < end; i++) {
+      pixels[i] = cgbColors[slots[i] >> 2][slots[i] & 0x3u];
+    }
+  } else {
+    auto *pixels = reinterpret_cast<uint16_t *>(dst);
+    for (int i = start; i < end; i++) {
+      pixels[i] = static_cast<uint16_t>(cgbColors[slots[i] >> 2][slots[i] & 0x3u]);
+    }
+  }
+}
 
+// CGB palette RAM holds little endian xBBBBBGGGGGRRRRR colors
+static uint32_t cgbColor(const std::array<uint8_t, 64> &ram, int offset, GPU_OUTPUT_FORMAT format) {
+  uint16_t raw = ram[offset] | (ram[offset + 1] << 8u);
+  GPU_PALETTE_ENTRY entry = GPU_PALETTE_ENTRY::rgb(raw & 0x1Fu, (raw >> 5u) & 0x1Fu, (raw >> 10u) & 0x1Fu);
+  return format == GPU_OUTPUT_FORMAT::ARGB8888 ? entry.argb8888() : entry.color;
+}
+
+void GPU::updateShades() {
+  const uint8_t registers[3] = {regs.bgPalette, regs.objPalette0, regs.objPalette1};
+  for (int p = 0; p < 3; p++) {
+    for (int color = 0; color < 4; color++) {
+      dmgShades[p][color] = (registers[p] >> (color * 2)) & 0x3u;
+    }
+  }
+  shadeKey = regs.dmgPalettes();
+}
+
+void GPU::updateColors() {
+  // Index formats output the palette slot itself, only color formats need the RGB LUT
+  if (format == GPU_OUTPUT_FORMAT::RGB555 || format == GPU_OUTPUT_FORMAT::ARGB8888) {
+    for (int p = 0; p < 8; p++) {
+      for (int color = 0; color < 4; color++) {
+        cgbColors[p][color] = cgbColor(mem->bgPaletteRam, p * 8 + color * 2, format);
+        cgbColors[p + 8][color] = cgbColor(mem->objPaletteRam, p * 8 + color * 2, format);
+      }
+    }
+  }
+  mem->paletteDirty = false;
 }
+
 void GPU::writeToVsyncBuffer() {
-  memcpy(vsyncBuffer.data(), framebuffer.data(), vsyncBuffer.size() * sizeof(GPU_PALETTE_ENTRY));
+  std::lock_guard<std::mutex> lock(vsyncMutex);
+  memcpy(vsyncBuffer.data(), framebuffer.data(), vsyncBuffer.size());
+  // CGB colors were already resolved line by line. Copied rather than swapped:
+  // columns outside the region of interest must keep what they last held.
+  std::copy(colorbuffer.begin(), colorbuffer.end(), vsyncColors.begin());
+  vsyncLineHashes = lineHashes;
+  vsyncHash.store(xxh64(reinterpret_cast<const uint8_t *>(lineHashes.data()), sizeof(lineHashes)), std::memory_order_release);
+  if (stackDepth != 0) {
+    // Each slot is stored twice, k slots apart, so the k frames starting at the
+    // oldest one are always contiguous
+    uint8_t *slot = &frameStackBuffer[stackHead * frameSize()];
+    expandInto(slot);
+    memcpy(slot + stackDepth * frameSize(), slot, frameSize());
+    stackHead = (stackHead + 1) % stackDepth;
+  }
+  completedFrames++;
+}
+
+// Expands `count` shade indices through a 4 entry LUT of `bytes`-wide colors.
+// Each output byte lane is a 16 byte table lookup, so SSSE3/NEON do it with a
+// byte shuffle and an interleave; the scalar loop handles whatever is left.
+template<size_t bytes>
+static void expandIndices(const uint8_t *src, uint8_t *dst, size_t count, const uint8_t (&lut)[4][bytes]) {
+  size_t i = 0;
+#if defined(__SSSE3__)
+  __m128i planes[bytes];
+  for (size_t b = 0; b < bytes; b++) {
+    planes[b] = _mm_setr_epi8(lut[0][b], lut[1][b], lut[2][b], lut[3][b], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  }
+  const __m128i mask = _mm_set1_epi8(0x3);
+  for (; i + 16 <= count; i += 16) {
+    __m128i idx = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)), mask);
+    __m128i p0 = _mm_shuffle_epi8(planes[0], idx);
+    __m128i p1 = _mm_shuffle_epi8(planes[1], idx);
+    __m128i *out = reinterpret_cast<__m128i *>(dst + i * bytes);
+    if (bytes == 2) {
+      _mm_storeu_si128(out, _mm_unpacklo_epi8(p0, p1));
+      _mm_storeu_si128(out + 1, _mm_unpackhi_epi8(p0, p1));
+    } else {
+      __m128i p2 = _mm_shuffle_epi8(planes[bytes > 2 ? 2 : 0], idx);
+      __m128i p3 = _mm_shuffle_epi8(planes[bytes > 3 ? 3 : 0], idx);
+      __m128i lo01 = _mm_unpacklo_epi8(p0, p1);
+      __m128i hi01 = _mm_unpackhi_epi8(p0, p1);
+      __m128i lo23 = _mm_unpacklo_epi8(p2, p3);
+      __m128i hi23 = _mm_unpackhi_epi8(p2, p3);
+      _mm_storeu_si128(out, _mm_unpacklo_epi16(lo01, lo23));
+      _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo01, lo23));
+      _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi01, hi23));
+      _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi01, hi23));
+    }
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  uint8x16_t planes[bytes];
+  for (size_t b = 0; b < bytes; b++) {
+    uint8_t table[16] = {lut[0][b], lut[1][b], lut[2][b], lut[3][b]};
+    planes[b] = vld1q_u8(table);
+  }
+  const uint8x16_t mask = vdupq_n_u8(0x3);
+  for (; i + 16 <= count; i += 16) {
+    uint8x16_t idx = vandq_u8(vld1q_u8(src + i), mask);
+    if (bytes == 2) {
+      uint8x16x2_t out{{vqtbl1q_u8(planes[0], idx), vqtbl1q_u8(planes[1], idx)}};
+      vst2q_u8(dst + i * bytes, out);
+    } else {
+      uint8x16x4_t out{{
+        vqtbl1q_u8(planes[0], idx), vqtbl1q_u8(planes[1], idx),
+        vqtbl1q_u8(planes[bytes > 2 ? 2 : 0], idx), vqtbl1q_u8(planes[bytes > 3 ? 3 : 0], idx)
+      }};
+      vst4q_u8(dst + i * bytes, out);
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    memcpy(dst + i * bytes, lut[src[i] & 0x3], bytes);
+  }
+}
+
+static void packIndices(const uint8_t *src, uint8_t *dst, size_t count) {
+  for (size_t i = 0; i < count; i += 4) {
+    dst[i / 4] = static_cast<uint8_t>((src[i] & 0x3) << 6 | (src[i + 1] & 0x3) << 4
+                                      | (src[i + 2] & 0x3) << 2 | (src[i + 3] & 0x3));
+  }
+}
+
+const uint8_t *GPU::frame() {
+  std::lock_guard<std::mutex> lock(vsyncMutex);
+  return expandFrame();
+}
+
+const uint8_t *GPU::expandFrame() {
+  if (format == GPU_OUTPUT_FORMAT::INDEX8 && !threaded) {
+    return vsyncBuffer.data();
+  }
+  if (outputFrame != completedFrames) {
+    outputFrame = completedFrames;
+    expandInto(output.data());
+  }
+  return output.data();
+}
+
+void GPU::expandInto(uint8_t *dst) {
+  if (!vsyncColors.empty()) {
+    memcpy(dst, vsyncColors.data(), frameSize());
+    return;
+  }
+
+  switch (format) {
+    case GPU_OUTPUT_FORMAT::RGB555: {
+      uint8_t lut[4][2];
+      for (int i = 0; i < 4; i++) {
+        memcpy(lut[i], &palette.entries[i].color, 2);
+      }
+      expandIndices(vsyncBuffer.data(), dst, vsyncBuffer.size(), lut);
+      break;
+    }
+    case GPU_OUTPUT_FORMAT::ARGB8888: {
+      uint8_t lut[4][4];
+      for (int i = 0; i < 4; i++) {
+        uint32_t color = palette.entries[i].argb8888();
+        memcpy(lut[i], &color, 4);
+      }
+      expandIndices(vsyncBuffer.data(), dst, vsyncBuffer.size(), lut);
+      break;
+    }
+    case GPU_OUTPUT_FORMAT::INDEX2:
+      packIndices(vsyncBuffer.data(), dst, vsyncBuffer.size());
+      break;
+    case GPU_OUTPUT_FORMAT::INDEX8:
+      memcpy(dst, vsyncBuffer.data(), vsyncBuffer.size());
+      break;
+  }
+}
+
+void GPU::setFrameStackDepth(size_t depth) {
+  std::lock_guard<std::mutex> lock(vsyncMutex);
+  stackDepth = depth;
+  stackHead = 0;
+  frameStackBuffer.assign(2 * depth * frameSize(), 0);
+}
+
+// Output pixel i covers source [i * src, (i + 1) * src) and source pixel j covers
+// [j * dst, (j + 1) * dst), both in 1/dst source pixels. Weights are rounded from
+// the running total of the overlap so each output's weights sum to exactly 256.
+static void buildResampleAxis(GPU_RESAMPLE_AXIS &axis, size_t src, size_t dst) {
+  axis.size = dst;
+  axis.first.clear();
+  axis.count.clear();
+  axis.offset.clear();
+  axis.weights.clear();
+  for (size_t i = 0; i < dst; i++) {
+    size_t start = i * src;
+    size_t end = start + src;
+    size_t first = start / dst;
+    axis.first.push_back(static_cast<uint16_t>(first));
+    axis.offset.push_back(static_cast<uint16_t>(axis.weights.size()));
+    size_t covered = 0;
+    uint16_t given = 0;
+    for (size_t j = first; j * dst < end; j++) {
+      size_t lo = std::max(start, j * dst);
+      size_t hi = std::min(end, (j + 1) * dst);
+      covered += hi - lo;
+      auto total = static_cast<uint16_t>((covered * 256 + src / 2) / src);
+      axis.weights.push_back(total - given);
+      given = total;
+    }
+    axis.count.push_back(static_cast<uint16_t>(axis.weights.size() - axis.offset.back()));
+  }
+}
+
+// Shade 0 is white
+static const uint8_t shadeIntensity[4] = {255, 170, 85, 0};
+
+// 2x2 box filter over shade indices: each output is the rounded mean of four
+// intensities, (4 * 255 - 85 * (sum of shades) + 2) / 4
+static void observeHalf(const uint8_t *src, uint8_t *dst) {
+  for (size_t y = 0; y < LINES / 2; y++) {
+    const uint8_t *row0 = src + y * 2 * LINE_WIDTH;
+    const uint8_t *row1 = row0 + LINE_WIDTH;
+    uint8_t *out = dst + y * LINE_WIDTH / 2;
+    size_t x = 0;
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi8(0x3);
+    const __m128i lowBytes = _mm_set1_epi16(0xFF);
+    const __m128i scale = _mm_set1_epi16(85);
+    const __m128i bias = _mm_set1_epi16(4 * 255 + 2);
+    for (; x + 32 <= LINE_WIDTH; x += 32) {
+      __m128i halves[2];
+      for (int h = 0; h < 2; h++) {
+        __m128i a = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + x + h * 16)), mask);
+        __m128i b = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + x + h * 16)), mask);
+        __m128i sum = _mm_add_epi8(a, b);
+        sum = _mm_add_epi16(_mm_and_si128(sum, lowBytes), _mm_srli_epi16(sum, 8));
+        halves[h] = _mm_srli_epi16(_mm_sub_epi16(bias, _mm_mullo_epi16(sum, scale)), 2);
+      }
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x / 2), _mm_packus_epi16(halves[0], halves[1]));
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t mask = vdupq_n_u8(0x3);
+    const uint16x8_t bias = vdupq_n_u16(4 * 255 + 2);
+    for (; x + 16 <= LINE_WIDTH; x += 16) {
+      uint8x16_t sum = vaddq_u8(vandq_u8(vld1q_u8(row0 + x), mask), vandq_u8(vld1q_u8(row1 + x), mask));
+      uint16x8_t value = vmlsq_n_u16(bias, vpaddlq_u8(sum), 85);
+      vst1_u8(out + x / 2, vshrn_n_u16(value, 2));
+    }
+#endif
+    for (; x < LINE_WIDTH; x += 2) {
+      int sum = (row0[x] & 0x3) + (row0[x + 1] & 0x3) + (row1[x] & 0x3) + (row1[x + 1] & 0x3);
+      out[x / 2] = static_cast<uint8_t>((4 * 255 - 85 * sum + 2) / 4);
+    }
+  }
+}
+
+void GPU::renderObservation(uint8_t *dst, size_t width, size_t height) {
+  std::lock_guard<std::mutex> lock(vsyncMutex);
+  if (width == LINE_WIDTH / 2 && height == LINES / 2) {
+    observeHalf(vsyncBuffer.data(), dst);
+    return;
+  }
+  if (observationColumns.size != width) {
+    buildResampleAxis(observationColumns, LINE_WIDTH, width);
+  }
+  if (observationRows.size != height) {
+    buildResampleAxis(observationRows, LINES, height);
+  }
+
+  // Separable: each contributing source row is filtered horizontally (weights
+  // sum to 256), then rows are accumulated with their vertical weights
+  std::vector<uint32_t> acc(width);
+  for (size_t y = 0; y < height; y++) {
+    std::fill(acc.begin(), acc.end(), 0);
+    for (size_t ty = 0; ty < observationRows.count[y]; ty++) {
+      const uint8_t *row = &vsyncBuffer[(observationRows.first[y] + ty) * LINE_WIDTH];
+      uint32_t rowWeight = observationRows.weights[observationRows.offset[y] + ty];
+      for (size_t x = 0; x < width; x++) {
+        const uint8_t *src = row + observationColumns.first[x];
+        const uint16_t *weights = &observationColumns.weights[observationColumns.offset[x]];
+        uint32_t value = 0;
+        for (size_t tx = 0; tx < observationColumns.count[x]; tx++) {
+          value += shadeIntensity[src[tx] & 0x3u] * weights[tx];
+        }
+        acc[x] += value * rowWeight;
+      }
+    }
+    for (size_t x = 0; x < width; x++) {
+      dst[y * width + x] = static_cast<uint8_t>((acc[x] + 0x8000u) >> 16u);
+    }
+  }
 }
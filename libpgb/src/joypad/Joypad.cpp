@@ -0,0 +1,44 @@
+#include "../../include/pgb/Joypad.hpp"
+
+#include <algorithm>
+
+void Joypad::queue(uint64_t clock, uint8_t buttons) {
+  // Equal stamps keep their queueing order
+  auto pos = std::upper_bound(events.begin(), events.end(), clock, [](uint64_t c, const JOYPAD_EVENT &e) {
+    return c < e.clock;
+  });
+  events.insert(pos, JOYPAD_EVENT{clock, buttons});
+}
+
+bool Joypad::update(uint64_t clock) {
+  bool fell = false;
+  while (!events.empty() && events.front().clock <= clock) {
+    uint8_t before = lines();
+    buttons = events.front().buttons;
+    events.pop_front();
+    fell |= (before & ~lines()) != 0;
+  }
+  return fell;
+}
+
+uint8_t Joypad::read() const {
+  wasPolled = true;
+  return 0xC0u | selectBits | lines();
+}
+
+bool Joypad::write(uint8_t value) {
+  uint8_t before = lines();
+  selectBits = value & 0x30u;
+  return (before & ~lines()) != 0;
+}
+
+uint8_t Joypad::lines() const {
+  uint8_t low = 0;
+  if ((selectBits & 0x10u) == 0) {
+    low |= buttons & 0x0Fu;
+  }
+  if ((selectBits & 0x20u) == 0) {
+    low |= buttons >> 4u;
+  }
+  return ~low & 0x0Fu;
+}
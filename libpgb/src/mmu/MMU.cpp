@@ -1,68 +1,333 @@
 #include "../../include/pgb/MMU.hpp"
 #include "../../include/pgb/GPU.hpp"
 
+#include <algorithm>
 #include <utility>
 
-MMU::MMU(std::shared_ptr<ROM> rom) : rom(std::move(rom)) {}
+MMU::MMU(std::shared_ptr<ROM> rom) : rom(std::move(rom)), apu(std::make_shared<APU>()) {
+  // CGB enhanced and CGB only carts run in CGB mode
+  if ((this->rom->header()->gbcFlag & 0x80u) != 0) {
+    model = GBMode::GBC;
+    gbcMode = true;
+  }
+  serial.fastClockAvailable = gbcMode;
+
+  mapMemory();
+}
+
+void MMU::mapMemory() {
+  mapRegion<ROM0>(&MMU::readRom, &MMU::writeRom);
+  mapRegion<ROMX>(&MMU::readRom, &MMU::writeRom);
+  mapRegion<SRAM>(&MMU::readSram, &MMU::writeSram);
+  mapRegion<WRAM0>(&MMU::readWram0, &MMU::writeWram0);
+  mapRegion<WRAMX>(&MMU::readWramx, &MMU::writeWramx);
+  mapRegion<ECHO>(&MMU::readEcho, &MMU::writeEcho);
+  mapRegion<IO>(&MMU::readHigh, &MMU::writeHigh);
+  updateAccessLocks();
+}
 
 uint8_t MMU::read8(uint16_t addr) {
   #if RECORD_MEMORY
   memoryReads[addr]++;
   #endif
-  if (ROM0::addrIsBelow(addr)) {
-    // ROM0
-    if (!cartInserted) {
-      return 0xFF;
-    } else {
-      return rom->read(addr);
+  return (this->*readHandlers[addr >> 8u])(addr);
+}
+
+void MMU::write8(uint16_t addr, uint8_t value) {
+  #if RECORD_MEMORY
+  memoryWrites[addr]++;
+  #endif
+  (this->*writeHandlers[addr >> 8u])(addr, value);
+}
+
+void MMU::setGpuMode(GPU_MODE mode) {
+  gpu_mode = mode;
+  updateAccessLocks();
+}
+
+// VRAM is unreachable while the GPU is drawing (mode 3), OAM while it is
+// scanning or drawing (modes 2 and 3). Swapping the handlers here, on mode
+// changes and LCDC writes, keeps the checks off the per-access path.
+void MMU::updateAccessLocks() {
+  if (dmaActive) {
+    // Everything below 0xFF00 stays locked until the DMA ends
+    return;
+  }
+  bool vramLocked = lcdPower() && gpu_mode == GPU_MODE::SCAN_VRAM;
+  bool oamLocked = lcdPower() && (gpu_mode == GPU_MODE::SCAN_OAM || gpu_mode == GPU_MODE::SCAN_VRAM);
+  if (vramLocked) {
+    mapRegion<VRAM>(&MMU::readLocked, &MMU::writeLocked);
+  } else {
+    mapRegion<VRAM>(&MMU::readVram, videoRecorder ? &MMU::writeVramRecorded : &MMU::writeVram);
+  }
+  // OAM and the unused area share the 0xFE page
+  if (oamLocked) {
+    mapRegion<OAM>(&MMU::readLocked, &MMU::writeLocked);
+  } else {
+    mapRegion<OAM>(&MMU::readOam, videoRecorder ? &MMU::writeOamRecorded : &MMU::writeOam);
+  }
+}
+
+void MMU::runEvents() {
+  if (dmaActive && clock >= dmaEndClock) {
+    dmaActive = false;
+    mapMemory();
+  }
+  if (joypad.update(clock)) {
+    requestInterrupt(INTERRUPT_JOYPAD);
+  }
+  if (serial.update(clock)) {
+    requestInterrupt(INTERRUPT_SERIAL);
+  }
+  nextEventClock = std::min({dmaActive ? dmaEndClock : UINT64_MAX, joypad.nextEvent(), serial.nextEvent()});
+}
+
+void MMU::queueInput(uint64_t at, uint8_t buttons) {
+  joypad.queue(at, buttons);
+  scheduleEvent(at);
+}
+
+// The whole transfer is done up front as one copy; for the 160 M-cycles the
+// hardware takes, the CPU can only reach the 0xFF page (IO and HRAM), which is
+// enforced by locking every other page once rather than checking per access.
+void MMU::startOamDma(uint8_t source) {
+  dmaSource = source;
+  uint16_t addr = source << 8u;
+  const uint8_t *src = directRead(addr);
+  if (src != nullptr) {
+    memcpy(video.oam.data(), src, video.oam.size());
+  } else {
+    for (uint8_t i = 0; i < video.oam.size(); i++) {
+      video.oam[i] = read8(addr + i);
     }
-  } else if (ROMX::addrIsBelow(addr)) {
-    // ROMX
-    if (!cartInserted) {
-      return 0xFF;
-    } else {
-      return rom->read(addr);
+  }
+  video.oamDirty = true;
+  if (videoRecorder) {
+    for (uint8_t i = 0; i < video.oam.size(); i++) {
+      videoRecorder->recordVideoWrite(GPU_COMMAND_TYPE::OAM, i, video.oam[i]);
     }
-  } else if (VRAM::addrIsBelow(addr)) {
-    // VRAM
-    if (lcdPower() && gpu_mode == GPU_MODE::SCAN_VRAM) {
-      return 0xFF;
+  }
+
+  dmaActive = true;
+  dmaEndClock = clock + CLOCK_OAM_DMA;
+  nextEventClock = std::min(nextEventClock, dmaEndClock);
+  mapRegion<MemoryMap<0x0000, 0xFEFF>>(&MMU::readLocked, &MMU::writeLocked);
+}
+
+// Bit 7 clear: general purpose DMA, copies everything now and stalls the CPU
+// for the whole transfer. Bit 7 set: HBlank DMA, one block per HBlank. Clearing
+// bit 7 while an HBlank DMA runs stops it instead.
+void MMU::startVramDma(uint8_t control) {
+  if (hdmaActive && (control & 0x80u) == 0) {
+    hdmaActive = false;
+    hdmaControl |= 0x80u;
+    return;
+  }
+  uint8_t blocks = (control & 0x7Fu) + 1;
+  if ((control & 0x80u) == 0) {
+    for (uint8_t i = 0; i < blocks; i++) {
+      copyVramDmaBlock();
     }
-    return vram[addr - VRAM::start];
-  } else if (SRAM::addrIsBelow(addr)) {
-    // SRAM
-    if (sramEnable) {
-      return rom->readSram(addr - SRAM::start);
-    } else {
-      return 0xFF;
+    clock += blocks * CLOCK_HDMA_BLOCK;
+    hdmaControl = 0xFF;
+    return;
+  }
+  hdmaActive = true;
+  hdmaControl = blocks - 1;
+  // Starting during HBlank moves the first block straight away
+  if (lcdPower() && gpu_mode == GPU_MODE::HBLANK) {
+    hdmaBlock();
+  }
+}
+
+void MMU::copyVramDmaBlock() {
+  uint16_t dest = hdmaDest & 0x1FF0u;
+  const uint8_t *src = directRead(hdmaSource);
+  std::array<uint8_t, 16> block{};
+  if (src == nullptr) {
+    for (uint8_t i = 0; i < block.size(); i++) {
+      block[i] = read8(hdmaSource + i);
     }
-  } else if (WRAM0::addrIsBelow(addr)) {
-    // WRAM0
-    return wramx[0][(addr - WRAM0::start) % WRAM0::size];
-  } else if (WRAMX::addrIsBelow(addr)) {
-    // WRAMAX
-    auto bank = ((model > GBMode::GBC) ? wram_bank : 1) % wramx.size();
-    if (bank == 0) bank = 1;
-    return wramx[bank][(addr - WRAMX::start) % WRAMX::size];
-  } else if (ECHO::addrIsBelow(addr)) {
-    // Weird unused echo memory
-    if (unusedMemoryDuplicateMode) {
-      uint8_t wram = read8(addr - ECHO::start + WRAM0::start);
-      uint8_t sram = read8(addr - ECHO::start + SRAM::start);
-      return wram & sram;
-    } else {
-      return read8(addr - ECHO::start + WRAM0::start);
+    src = block.data();
+  }
+  video.writeVramBlock(vramBankIndex, dest, src, 16);
+  if (videoRecorder) {
+    for (uint8_t i = 0; i < 16; i++) {
+      videoRecorder->recordVideoWrite(vramBankIndex != 0 ? GPU_COMMAND_TYPE::VRAM1 : GPU_COMMAND_TYPE::VRAM0, dest + i, src[i]);
     }
-  } else if (OAM::addrIsBelow(addr)) {
-    // Object attribute table (sprite info table)
-    uint16_t off = addr - OAM::start;
-    if (off >= oam.size()) return 0xFF;
-    if (lcdPower() && (gpu_mode == GPU_MODE::SCAN_OAM || gpu_mode == GPU_MODE::SCAN_VRAM)) return 0xFF;
-    return oam[off];
-  } else if (UNUSED::addrIsBelow(addr)) {
-    //TODO unused area weirdness depending on mode
-    return 0;
-  } else if (IO::addrIsBelow(addr)) {
+  }
+  hdmaSource += 16;
+  hdmaDest = dest + 16;
+}
+
+void MMU::hdmaBlock() {
+  copyVramDmaBlock();
+  clock += CLOCK_HDMA_BLOCK;
+  if (hdmaControl == 0) {
+    hdmaActive = false;
+    hdmaControl = 0xFF;
+  } else {
+    hdmaControl--;
+  }
+}
+
+// Backing memory behind a DMA source address, or nullptr where there is none
+// (a disabled or missing cart) and the transfer has to go through the handlers
+const uint8_t *MMU::directRead(uint16_t addr) {
+  if (ECHO::inRange(addr) || addr > ECHO::end) {
+    addr -= ECHO::start - WRAM0::start;
+  }
+  if (ROMX::addrIsBelow(addr)) {
+    return cartInserted ? rom->romPointer(addr) : nullptr;
+  } else if (VRAM::addrIsBelow(addr)) {
+    return &video.vram[vramBankIndex][addr - VRAM::start];
+  } else if (SRAM::addrIsBelow(addr)) {
+    return sramEnable ? rom->sramPointer(addr - SRAM::start) : nullptr;
+  } else if (WRAM0::addrIsBelow(addr)) {
+    return &wramx[0][addr - WRAM0::start];
+  } else {
+    return &wramx[wramxBank()][addr - WRAMX::start];
+  }
+}
+
+void MMU::recordVideoWrites(GPU *gpu) {
+  videoRecorder = gpu;
+  updateAccessLocks();
+}
+
+GPU_LINE_REGISTERS MMU::lineRegisters() const {
+  GPU_LINE_REGISTERS regs{};
+  regs.line = static_cast<uint8_t>(gpu_line);
+  regs.lcdControl = lcdControl;
+  regs.scrollX = scrollX;
+  regs.scrollY = scrollY;
+  regs.windowX = windowX;
+  regs.windowY = windowY;
+  regs.bgPalette = bgPalette;
+  regs.objPalette0 = objPalette0;
+  regs.objPalette1 = objPalette1;
+  return regs;
+}
+
+uint8_t MMU::readLocked(uint16_t) {
+  return 0xFF;
+}
+
+void MMU::writeLocked(uint16_t, uint8_t) {
+  // ignore
+}
+
+uint8_t MMU::readRom(uint16_t addr) {
+  if (!cartInserted) {
+    return 0xFF;
+  } else {
+    return rom->read(addr);
+  }
+}
+
+void MMU::writeRom(uint16_t addr, uint8_t value) {
+  if (cartInserted) {
+    rom->write(addr, value);
+  }
+}
+
+uint8_t MMU::readVram(uint16_t addr) {
+  return video.vram[vramBankIndex][addr - VRAM::start];
+}
+
+void MMU::writeVram(uint16_t addr, uint8_t value) {
+  video.writeVram(vramBankIndex, addr - VRAM::start, value);
+}
+
+void MMU::writeVramRecorded(uint16_t addr, uint8_t value) {
+  writeVram(addr, value);
+  videoRecorder->recordVideoWrite(vramBankIndex != 0 ? GPU_COMMAND_TYPE::VRAM1 : GPU_COMMAND_TYPE::VRAM0, addr - VRAM::start, value);
+}
+
+uint8_t MMU::readSram(uint16_t addr) {
+  if (sramEnable) {
+    return rom->readSram(addr - SRAM::start);
+  } else {
+    return 0xFF;
+  }
+}
+
+void MMU::writeSram(uint16_t addr, uint8_t value) {
+  if (sramEnable) {
+    rom->writeSram(addr - SRAM::start, value);
+  }
+}
+
+uint8_t MMU::readWram0(uint16_t addr) {
+  return wramx[0][(addr - WRAM0::start) % WRAM0::size];
+}
+
+void MMU::writeWram0(uint16_t addr, uint8_t value) {
+  wramx[0][(addr - WRAM0::start) % WRAM0::size] = value;
+}
+
+uint8_t MMU::wramxBank() const {
+  auto bank = ((model > GBMode::GBC) ? wram_bank : 1) % wramx.size();
+  if (bank == 0) bank = 1;
+  return bank;
+}
+
+uint8_t MMU::readWramx(uint16_t addr) {
+  return wramx[wramxBank()][(addr - WRAMX::start) % WRAMX::size];
+}
+
+void MMU::writeWramx(uint16_t addr, uint8_t value) {
+  auto bank = ((model > GBMode::GBC) ? wram_bank : 1) % wramx.size();
+  wramx[bank][(addr - WRAMX::start) % WRAMX::size] = value;
+}
+
+uint8_t MMU::readEcho(uint16_t addr) {
+  // Weird unused echo memory
+  if (unusedMemoryDuplicateMode) {
+    uint8_t wram = read8(addr - ECHO::start + WRAM0::start);
+    uint8_t sram = read8(addr - ECHO::start + SRAM::start);
+    return wram & sram;
+  } else {
+    return read8(addr - ECHO::start + WRAM0::start);
+  }
+}
+
+void MMU::writeEcho(uint16_t addr, uint8_t value) {
+  // Weird mirror unused memory
+  if (unusedMemoryDuplicateMode) {
+    write8(addr - ECHO::start + WRAM0::start, value);
+    write8(addr - ECHO::start + SRAM::start, value);
+  } else {
+    write8(addr - ECHO::start + WRAM0::start, value);
+  }
+}
+
+uint8_t MMU::readOam(uint16_t addr) {
+  // Object attribute table (sprite info table)
+  if (OAM::inRange(addr)) {
+    return video.oam[addr - OAM::start];
+  }
+  //TODO unused area weirdness depending on mode
+  return 0;
+}
+
+void MMU::writeOam(uint16_t addr, uint8_t value) {
+  if (OAM::inRange(addr)) {
+    video.writeOam(addr - OAM::start, value);
+  }
+  //TODO unused area weirdness depending on mode
+  // for now, ignore
+}
+
+void MMU::writeOamRecorded(uint16_t addr, uint8_t value) {
+  if (OAM::inRange(addr)) {
+    writeOam(addr, value);
+    videoRecorder->recordVideoWrite(GPU_COMMAND_TYPE::OAM, addr - OAM::start, value);
+  }
+}
+
+uint8_t MMU::readHigh(uint16_t addr) {
+  if (IO::addrIsBelow(addr)) {
     return ioread(addr);
   } else if (HRAM::addrIsBelow(addr)) {
     // Internal CPU ram
@@ -73,56 +338,8 @@ uint8_t MMU::read8(uint16_t addr) {
   }
 }
 
-void MMU::write8(uint16_t addr, uint8_t value) {
-  #if RECORD_MEMORY
-  memoryWrites[addr]++;
-  #endif
-  if (ROM0::addrIsBelow(addr)) {
-    //ROM0
-    if (cartInserted) {
-      rom->write(addr, value);
-    }
-  } else if (ROMX::addrIsBelow(addr)) {
-    //ROMX
-    if (cartInserted) {
-      rom->write(addr, value);
-    }
-  } else if (VRAM::addrIsBelow(addr)) {
-    //VRAM
-    if (!lcdPower() || gpu_mode != GPU_MODE::SCAN_VRAM) {
-      vram[addr - VRAM::start] = value;
-    }
-  } else if (SRAM::addrIsBelow(addr)) {
-    //SRAM
-    if (sramEnable) {
-      rom->writeSram(addr - SRAM::start, value);
-    }
-  } else if (WRAM0::addrIsBelow(addr)) {
-    //WRAM0
-    wramx[0][(addr - WRAM0::start) % WRAM0::size] = value;
-  } else if (WRAMX::addrIsBelow(addr)) {
-    //WRAMX
-    auto bank = ((model > GBMode::GBC) ? wram_bank : 1) % wramx.size();
-    wramx[bank][(addr - WRAMX::start) % WRAMX::size] = value;
-  } else if (ECHO::addrIsBelow(addr)) {
-    // Weird mirror unused memory
-    if (unusedMemoryDuplicateMode) {
-      write8(addr - ECHO::start + WRAM0::start, value);
-      write8(addr - ECHO::start + SRAM::start, value);
-    } else {
-      write8(addr - ECHO::start + WRAM0::start, value);
-    }
-  } else if (OAM::addrIsBelow(addr)) {
-    uint16_t off = addr - OAM::start;
-    if (off < oam.size()) {
-      if (!lcdPower() || (gpu_mode != GPU_MODE::SCAN_OAM && gpu_mode != GPU_MODE::SCAN_VRAM)) {
-        oam[off] = value;
-      }
-    }
-  } else if (UNUSED::addrIsBelow(addr)) {
-    //TODO unused area weirdness depending on mode
-    // for now, ignore
-  } else if (IO::addrIsBelow(addr)) {
+void MMU::writeHigh(uint16_t addr, uint8_t value) {
+  if (IO::addrIsBelow(addr)) {
     // IO registers
     iowrite(addr, value);
   } else if (HRAM::addrIsBelow(addr)) {
@@ -134,17 +351,32 @@ void MMU::write8(uint16_t addr, uint8_t value) {
 }
 
 void MMU::iowrite(uint16_t addr, uint8_t value) {
-  if (addr == 0xFF01) { // serial read/write sb
-    printf("%c", value);
+  if (addr >= 0xFF10 && addr <= 0xFF3F) { // Sound
+    apu->write(addr, value, clock);
+    return;
+  }
+  if (addr == 0xFF00) { // Joypad/P1
+    if (joypad.write(value)) {
+      requestInterrupt(INTERRUPT_JOYPAD);
+    }
+  }
+  if (addr == 0xFF01 || addr == 0xFF02) { // Serial data/SB and control/SC
+    serial.write(addr, value, clock);
+    scheduleEvent(serial.nextEvent());
   }
   if (addr == 0xFF40) { // LCD/GPU control
     this->lcdControl = value;
+    updateAccessLocks();
+  }
+  if (addr == 0xFF0F) { // Interrupt flags/IF
+    this->interrupt_flag = value & 0x1Fu;
   }
   if (addr == 0xFF41) { // LCD Status/STAT
-    lycCheckEnable = (addr & 0x40) > 0;
-    mode2OamCheckEnable = (addr & 0x20) > 0;
-    mode1VblankCheckEnable = (addr & 0x10) > 0;
-    mode0HblankCheckEnable = (addr & 0x08) > 0;
+    lycCheckEnable = (value & 0x40) > 0;
+    mode2OamCheckEnable = (value & 0x20) > 0;
+    mode1VblankCheckEnable = (value & 0x10) > 0;
+    mode0HblankCheckEnable = (value & 0x08) > 0;
+    updateStat();
   }
   if (addr == 0xFF42) { // Scroll x
     this->scrollX = value;
@@ -157,19 +389,75 @@ void MMU::iowrite(uint16_t addr, uint8_t value) {
   }
   if (addr == 0xFF45) { // Scan line compare/LY Compare/LYC
     lycCompare = value;
+    updateStat();
+  }
+  if (addr == 0xFF46) { // OAM DMA
+    startOamDma(value);
   }
   if (addr == 0xFF47) { // Background palette
-    // TODO: background palette
+    this->bgPalette = value;
+  }
+  if (addr == 0xFF48) { // Object palette 0
+    this->objPalette0 = value;
+  }
+  if (addr == 0xFF49) { // Object palette 1
+    this->objPalette1 = value;
+  }
+  if (addr == 0xFF4A) { // Window Y
+    this->windowY = value;
+  }
+  if (addr == 0xFF4B) { // Window X + 7
+    this->windowX = value;
+  }
+  if (addr == 0xFF68) { // CGB background palette index/BCPS
+    this->bgPaletteIndex = value & 0xBFu;
+  }
+  if (addr == 0xFF69) { // CGB background palette data/BCPD
+    writePaletteRam(GPU_COMMAND_TYPE::BG_PALETTE, bgPaletteIndex, value);
+  }
+  if (addr == 0xFF6A) { // CGB object palette index/OCPS
+    this->objPaletteIndex = value & 0xBFu;
+  }
+  if (addr == 0xFF6B) { // CGB object palette data/OCPD
+    writePaletteRam(GPU_COMMAND_TYPE::OBJ_PALETTE, objPaletteIndex, value);
+  }
+  if (gbcMode && addr == 0xFF51) { // HDMA source high
+    hdmaSource = (hdmaSource & 0x00FFu) | value << 8u;
+  }
+  if (gbcMode && addr == 0xFF52) { // HDMA source low
+    hdmaSource = (hdmaSource & 0xFF00u) | (value & 0xF0u);
+  }
+  if (gbcMode && addr == 0xFF53) { // HDMA destination high, within VRAM
+    hdmaDest = (hdmaDest & 0x00FFu) | (value & 0x1Fu) << 8u;
+  }
+  if (gbcMode && addr == 0xFF54) { // HDMA destination low
+    hdmaDest = (hdmaDest & 0xFF00u) | (value & 0xF0u);
+  }
+  if (gbcMode && addr == 0xFF55) { // HDMA length/mode/start
+    startVramDma(value);
   }
   if (addr == 0xFF70) {
     this->wram_bank = value & 0x3u;
   }
   if (addr == 0xFF4F) {
     this->vram_bank = value & 0x1u;
+    vramBankIndex = (gbcMode && vram_bank != 0) ? 1 : 0;
   }
 }
 
 uint8_t MMU::ioread(uint16_t addr) const {
+  if (addr >= 0xFF10 && addr <= 0xFF3F) { // Sound
+    return apu->read(addr, clock);
+  }
+  if (addr == 0xFF00) { // Joypad/P1
+    return joypad.read();
+  }
+  if (addr == 0xFF01 || addr == 0xFF02) { // Serial data/SB and control/SC
+    return serial.read(addr);
+  }
+  if (addr == 0xFF0F) { // Interrupt flags/IF
+    return 0xE0u | this->interrupt_flag;
+  }
   if (addr == 0xFF40) { // LCD/GPU control
     return this->lcdControl;
   }
@@ -193,9 +481,38 @@ uint8_t MMU::ioread(uint16_t addr) const {
   if (addr == 0xFF45) { // Scan line compare/LY compare/LYC
     return lycCompare;
   }
-
+  if (addr == 0xFF46) { // OAM DMA
+    return dmaSource;
+  }
   if (addr == 0xFF47) { // Background palette
-    // TODO: background palette
+    return this->bgPalette;
+  }
+  if (addr == 0xFF48) { // Object palette 0
+    return this->objPalette0;
+  }
+  if (addr == 0xFF49) { // Object palette 1
+    return this->objPalette1;
+  }
+  if (addr == 0xFF4A) { // Window Y
+    return this->windowY;
+  }
+  if (addr == 0xFF4B) { // Window X + 7
+    return this->windowX;
+  }
+  if (addr == 0xFF68) { // CGB background palette index/BCPS
+    return 0x40u | this->bgPaletteIndex;
+  }
+  if (addr == 0xFF69) { // CGB background palette data/BCPD
+    return video.bgPaletteRam[bgPaletteIndex & 0x3Fu];
+  }
+  if (addr == 0xFF6A) { // CGB object palette index/OCPS
+    return 0x40u | this->objPaletteIndex;
+  }
+  if (addr == 0xFF6B) { // CGB object palette data/OCPD
+    return video.objPaletteRam[objPaletteIndex & 0x3Fu];
+  }
+  if (gbcMode && addr == 0xFF55) { // HDMA remaining blocks - 1, bit 7 set when idle
+    return hdmaControl;
   }
   if (addr == 0xFF70) {
     return 0xF8u | this->wram_bank;
@@ -206,6 +523,30 @@ uint8_t MMU::ioread(uint16_t addr) const {
   return 0xFF;
 }
 
+void MMU::updateStat() {
+  bool line = lcdPower() && (
+    (lycCheckEnable && lycCompare == gpu_line)
+    || (mode0HblankCheckEnable && gpu_mode == GPU_MODE::HBLANK)
+    || (mode1VblankCheckEnable && gpu_mode == GPU_MODE::VBLANK)
+    || (mode2OamCheckEnable && gpu_mode == GPU_MODE::SCAN_OAM)
+  );
+  if (line && !statLine) {
+    requestInterrupt(INTERRUPT_LCD_STAT);
+  }
+  statLine = line;
+}
+
+void MMU::writePaletteRam(GPU_COMMAND_TYPE type, uint8_t &index, uint8_t value) {
+  uint8_t offset = index & 0x3Fu;
+  video.writePalette(type == GPU_COMMAND_TYPE::BG_PALETTE ? video.bgPaletteRam : video.objPaletteRam, offset, value);
+  if (videoRecorder) {
+    videoRecorder->recordVideoWrite(type, offset, value);
+  }
+  if (index & 0x80u) { // auto increment
+    index = 0x80u | ((index + 1) & 0x3Fu);
+  }
+}
+
 uint16_t MMU::read16(uint16_t addr) {
   return read8(addr) | (read8(addr + 1) << 8u);
 }
@@ -216,16 +557,16 @@ void MMU::write16(uint16_t addr, uint16_t value) {
 }
 
 uint8_t MMU::oamread(uint16_t addr) {
-  if (addr < oam.size()) return oam[addr];
+  if (addr < video.oam.size()) return video.oam[addr];
   return 0xFF;
 }
 
 uint8_t MMU::vramread(uint16_t addr) {
-  if (addr < vram.size()) return vram[addr];
+  if (addr < video.vram[0].size()) return video.vram[0][addr];
   return 0xFF;
 }
 
 uint8_t MMU::vram2read(uint16_t addr) {
-  if (addr < vram2.size()) return vram2[addr];
+  if (addr < video.vram[1].size()) return video.vram[1][addr];
   return 0xFF;
 }
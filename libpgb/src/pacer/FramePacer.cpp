@@ -0,0 +1,55 @@
+#include "../../include/pgb/FramePacer.hpp"
+#include "../../include/pgb/APU.hpp"
+
+#include <thread>
+
+constexpr std::chrono::milliseconds FramePacer::MAX_LAG;
+
+FramePacer::FramePacer(const AudioSink *audio) : audio(audio) {
+}
+
+void FramePacer::setSpeed(double speed) {
+  multiplier = speed;
+  started = false;
+}
+
+void FramePacer::waitUntil(uint64_t clock) {
+  if (multiplier <= 0) {
+    return;
+  }
+  if (audioClocked()) {
+    waitForAudio();
+    return;
+  }
+  if (!started || clock < startClock) {
+    restart(clock);
+    return;
+  }
+
+  std::chrono::duration<double> elapsed((clock - startClock) / (CLOCK_RATE * multiplier));
+  Clock::time_point target = startTime + std::chrono::duration_cast<Clock::duration>(elapsed);
+  Clock::time_point now = Clock::now();
+  if (now - target > MAX_LAG) {
+    // Too slow to keep up (or the host stalled): don't try to catch up in a burst
+    restart(clock);
+  } else if (target > now) {
+    std::this_thread::sleep_until(target);
+  }
+}
+
+void FramePacer::waitForAudio() {
+  // The device drains the queue in real time, so anything past the target
+  // depth is exactly how far ahead the emulator is
+  size_t queued = audio->queuedFrames();
+  size_t target = audio->targetFrames();
+  if (queued > target) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(static_cast<double>(queued - target) / audio->inputRate()));
+  }
+  started = false;
+}
+
+void FramePacer::restart(uint64_t clock) {
+  started = true;
+  startTime = Clock::now();
+  startClock = clock;
+}
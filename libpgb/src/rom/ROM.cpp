@@ -1,10 +1,39 @@
 #include "../../include/pgb/ROM.hpp"
 
+#include <cstdio>
+#include <cstring>
 #include <utility>
 #include <cmath>
 
-ROM::ROM(std::vector<std::array<uint8_t, BANK_SIZE>> banks) : banks(std::move(banks)) {
-  cartType = static_cast<CART_TYPE>(this->header()->cartType);
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define PGB_MMAP 1
+#endif
+
+ROM::~ROM() {
+#if PGB_MMAP
+  if (mapping != nullptr) {
+    munmap(mapping, mappingSize);
+  }
+#endif
+}
+
+void ROM::mapBanks(const uint8_t *data, size_t size) {
+  size_t whole = size / BANK_SIZE;
+  banks.reserve(whole + 1);
+  for (size_t i = 0; i < whole; i++) {
+    banks.push_back(data + i * BANK_SIZE);
+  }
+  // Always at least one bank, so the header can be read from anything
+  if (size % BANK_SIZE != 0 || size == 0) {
+    tail.resize(BANK_SIZE);
+    if (size % BANK_SIZE != 0) {
+      memcpy(tail.data(), data + whole * BANK_SIZE, size % BANK_SIZE);
+    }
+    banks.push_back(tail.data());
+  }
+  cartType = static_cast<CART_TYPE>(header()->cartType);
 }
 
 uint8_t ROM::read(uint16_t offset) {
@@ -136,31 +165,62 @@ void ROM::writeSram(uint16_t offset, uint8_t value) {
   }
 }
 
+const uint8_t *ROM::romPointer(uint16_t offset) {
+  if (offset < BANK_SIZE) {
+    return banks[0] + offset;
+  }
+  return banks[rom_bank % banks.size()] + (offset - BANK_SIZE);
+}
+
+const uint8_t *ROM::sramPointer(uint16_t offset) {
+  if (ram_enabled) {
+    return &sram[ram_mode ? 0 : (ram_bank % 4)][offset];
+  } else {
+    return nullptr;
+  }
+}
+
 std::shared_ptr<ROM> ROM::readRom(FILE *file) {
-  // TODO: safety checks lmao
-  std::vector<std::array<uint8_t, BANK_SIZE>> banks;
+#if PGB_MMAP
+  // The mapping stays valid after the caller closes the file
+  int fd = fileno(file);
+  struct stat info{};
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+    size_t size = static_cast<size_t>(info.st_size);
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+      std::shared_ptr<ROM> rom(new ROM());
+      rom->mapping = mapping;
+      rom->mappingSize = size;
+      rom->mapBanks(static_cast<const uint8_t *>(mapping), size);
+      return rom;
+    }
+  }
+#endif
 
-  int read = 0;
+  // Pipes, or no mmap: read it all
+  std::vector<uint8_t> bytes;
   std::array<uint8_t, BANK_SIZE> buffer{};
+  size_t read;
   while ((read = fread(buffer.data(), 1, BANK_SIZE, file)) > 0) {
-    banks.emplace_back();
-    memcpy(banks[banks.size() - 1].data(), buffer.data(), read);
+    bytes.insert(bytes.end(), buffer.begin(), buffer.begin() + read);
   }
-
-  return std::shared_ptr<ROM>(new ROM(std::move(banks)));
+  return readRom(std::move(bytes));
 }
 
 std::shared_ptr<ROM> ROM::readRom(std::vector<uint8_t> bytes) {
-  std::vector<std::array<uint8_t, BANK_SIZE>> banks;
-  for (int i = 0; i < bytes.size(); i += BANK_SIZE) {
-    banks.emplace_back();
-    size_t read = bytes.size() - i;
-    if (read > BANK_SIZE) read = BANK_SIZE;
-    memcpy(banks[banks.size() - 1].data(), bytes.data() + i, read);
-  }
-  return std::shared_ptr<ROM>(new ROM(std::move(banks)));
+  std::shared_ptr<ROM> rom(new ROM());
+  rom->storage = std::move(bytes);
+  rom->mapBanks(rom->storage.data(), rom->storage.size());
+  return rom;
+}
+
+std::shared_ptr<ROM> ROM::borrowRom(const uint8_t *data, size_t size) {
+  std::shared_ptr<ROM> rom(new ROM());
+  rom->mapBanks(data, size);
+  return rom;
 }
 
-GBHeader *ROM::header() {
-  return reinterpret_cast<GBHeader *>(&(banks[0][0x100]));
+const GBHeader *ROM::header() const {
+  return reinterpret_cast<const GBHeader *>(banks[0]);
 }
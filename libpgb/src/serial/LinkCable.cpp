@@ -0,0 +1,63 @@
+#include "../../include/pgb/LinkCable.hpp"
+
+#include <algorithm>
+#include <utility>
+
+LinkCable::LinkCable(std::shared_ptr<GameBoy> first, std::shared_ptr<GameBoy> second)
+  : first(std::move(first)), second(std::move(second)) {
+  this->first->mmu->serial.connect(&this->second->mmu->serial);
+  for (GameBoy *gb : {this->first.get(), this->second.get()}) {
+    gb->mmu->serial.setControlCallback([this, gb] {
+      // The new transfer would complete inside the window, possibly before the
+      // other machine's position; stop so the next window can end on it
+      if (gb->mmu->serial.nextEvent() < windowEnd) {
+        gb->stop();
+      }
+    });
+  }
+}
+
+LinkCable::~LinkCable() {
+  first->mmu->serial.setControlCallback(nullptr);
+  second->mmu->serial.setControlCallback(nullptr);
+  first->mmu->serial.connect(nullptr);
+}
+
+void LinkCable::runUntil(uint64_t clock) {
+  GameBoy *a = first.get();
+  GameBoy *b = second.get();
+  while (std::min(a->clock(), b->clock()) < clock) {
+    uint64_t base = std::min(a->clock(), b->clock());
+    uint64_t window = std::min(a->mmu->serial.byteTime(), b->mmu->serial.byteTime());
+    uint64_t target = std::min(clock, base + window);
+    // Stop on the next transfer completion. One already due is handled by
+    // that machine's next instruction.
+    for (GameBoy *gb : {a, b}) {
+      uint64_t transfer = gb->mmu->serial.nextEvent();
+      if (transfer > base) {
+        target = std::min(target, transfer);
+      }
+      gb->mmu->scheduleEvent(transfer);
+    }
+
+    // The clocking side swaps bytes when it reaches the target, so the other
+    // side must already be there
+    GameBoy *last = a->mmu->serial.nextEvent() == target ? a : b;
+    GameBoy *firstToRun = last == a ? b : a;
+    windowEnd = target;
+    firstToRun->runUntil(windowEnd);
+    // If it stopped early the other side only catches up to it
+    windowEnd = std::min(windowEnd, firstToRun->clock());
+    last->runUntil(windowEnd);
+    // An SC write on the side that ran second can start a transfer due before
+    // the point the other side already reached. It can't swap bytes in the
+    // other side's past, so it completes once both are there.
+    last->mmu->serial.postpone(firstToRun->clock());
+    // A completed exchange may have finished the other side's transfer
+    firstToRun->mmu->scheduleEvent(firstToRun->mmu->serial.nextEvent());
+  }
+}
+
+void LinkCable::runFrame() {
+  runUntil((std::min(first->frame(), second->frame()) + 1) * CLOCK_FRAME);
+}
@@ -0,0 +1,90 @@
+#include "../../include/pgb/Serial.hpp"
+
+#include <utility>
+
+uint8_t Serial::read(uint16_t addr) const {
+  if (addr == 0xFF01) {
+    return data;
+  }
+  return (fastClockAvailable ? 0x7Cu : 0x7Eu) | control;
+}
+
+void Serial::write(uint16_t addr, uint8_t value, uint64_t clock) {
+  if (addr == 0xFF01) {
+    data = value;
+    return;
+  }
+  control = value & (fastClockAvailable ? 0x83u : 0x81u);
+  if ((control & 0x81u) == 0x81u) {
+    transferEnd = clock + byteTime();
+  } else {
+    // Stopped, or waiting on an external clock that isn't there
+    transferEnd = UINT64_MAX;
+  }
+  if (onControl) {
+    onControl();
+  }
+}
+
+bool Serial::update(uint64_t clock) {
+  if (clock < transferEnd) {
+    return false;
+  }
+  // The exchange happens on the cycle the transfer was due, not on the
+  // instruction boundary that noticed it
+  uint64_t end = transferEnd;
+  transferEnd = UINT64_MAX;
+  control &= 0x7Fu;
+  if (control & 0x01u) {
+    uint8_t out = data;
+    data = peer != nullptr ? peer->clockIn(out, end) : 0xFF;
+    finish(out);
+  } else {
+    // Externally clocked: the peer already swapped the bytes
+    finish(shiftedOut);
+  }
+  return true;
+}
+
+Serial::~Serial() {
+  connect(nullptr);
+}
+
+void Serial::connect(Serial *other) {
+  if (peer != nullptr) {
+    peer->peer = nullptr;
+  }
+  peer = other;
+  if (other != nullptr) {
+    if (other->peer != nullptr) {
+      other->peer->peer = nullptr;
+    }
+    other->peer = this;
+  }
+}
+
+uint8_t Serial::clockIn(uint8_t in, uint64_t clock) {
+  uint8_t out = data;
+  data = in;
+  if ((control & 0x81u) == 0x80u) {
+    // A transfer waiting on the external clock completes with the peer's
+    shiftedOut = out;
+    transferEnd = clock;
+  }
+  return out;
+}
+
+void Serial::finish(uint8_t out) {
+  sent.push_back(out);
+  if (onByte) {
+    onByte(out);
+  }
+}
+
+void Serial::setCallback(std::function<void(uint8_t)> callback) {
+  onByte = std::move(callback);
+}
+
+void Serial::setControlCallback(std::function<void()> callback) {
+  onControl = std::move(callback);
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <QFile>
 #include <QTextStream>
 #include <QFileDialog>
@@ -45,10 +46,10 @@ void MainWindow::loadRom() {
   bytes.resize(array.size());
   memcpy(bytes.data(), array.data(), bytes.size());
 
-  pixMap->rom = ROM::readRom(bytes);
+  pixMap->rom = ROM::readRom(std::move(bytes));
   pixMap->mmu = std::make_shared<MMU>(pixMap->rom);
   pixMap->cpu = std::make_shared<CPU>(pixMap->mmu);
-  pixMap->gpu = std::make_shared<GPU>(pixMap->mmu);
+  pixMap->gpu = std::make_shared<GPU>(pixMap->mmu, GPU_OUTPUT_FORMAT::ARGB8888, ui->threadedRenderCheck->isChecked());
 }
 
 void MainWindow::on_romLoadButton_clicked() {
@@ -60,17 +61,19 @@ void GBPixMap::advance(int phase) {
     if (cpu) {
       uint64_t frame = cpu->clock() / CLOCK_FRAME;
       while (true) {
-        uint64_t startClock = cpu->clock();
         cpu->emulateInstruction();
+        if (cpu->halted()) {
+          cpu->haltUntil(std::min({gpu->nextEvent(), mmu->nextEvent(), (frame + 1) * CLOCK_FRAME}));
+        }
         uint64_t endClock = cpu->clock();
-        gpu->update(endClock - startClock);
+        gpu->advanceTo(endClock);
         uint64_t newFrame = endClock / CLOCK_FRAME;
         if (newFrame != frame) {
 //          cpu->printState();
           QImage image(
-            (uchar *) (gpu->framebuffer.data()),
-            LINE_WIDTH, LINES,
-            QImage::Format::Format_RGB555
+            gpu->frame(),
+            LINE_WIDTH, LINES, gpu->frameStride(),
+            QImage::Format::Format_RGB32
           );
           setPixmap(QPixmap::fromImage(image));
           break;